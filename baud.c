@@ -0,0 +1,43 @@
+// Arbitrary serial port speeds
+//
+// itobaud() in main.c only knows the speed_t constants from termios.h.
+// Linux has none for 76800, the TPDD1 DIP switch rate, or for any other
+// non-standard rate, but it can still set any integer rate with the
+// termios2 ioctls and BOTHER, like ref/baud_linux.c. This has to be in a
+// file by itself, because the kernel's termios headers can't be included
+// along with <termios.h>.
+//
+// On the BSDs and macOS, speed_t is just the rate, and itobaud() passes
+// it through, so this isn't needed there.
+
+#include <stdint.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#endif
+
+#include "baud.h"
+
+// set fd to baud, after tcsetattr() has set everything else
+// returns 0 on success, -1 and errno if not
+int set_any_baud(int fd, uint32_t baud) {
+#if defined(__linux__) && defined(TCGETS2) && defined(BOTHER)
+	struct termios2 t;
+	if (ioctl(fd,TCGETS2,&t)) return -1;
+	t.c_cflag &= ~CBAUD;
+	t.c_cflag |= BOTHER;
+	t.c_ispeed = baud;
+	t.c_ospeed = baud;
+	if (ioctl(fd,TCSETS2,&t)) return -1;
+	// the driver may have rounded it, within reason is fine
+	if (ioctl(fd,TCGETS2,&t)) return -1;
+	if (t.c_ospeed<baud-baud/50 || t.c_ospeed>baud+baud/50) { errno = EINVAL; return -1; }
+	return 0;
+#else
+	(void)fd; (void)baud;
+	errno = EINVAL;
+	return -1;
+#endif
+}
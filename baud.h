@@ -0,0 +1,10 @@
+// Serial port speeds that termios.h has no speed_t constant for, see baud.c
+
+#ifndef BAUD_H
+#define BAUD_H
+
+#include <stdint.h>
+
+int set_any_baud (int fd, uint32_t baud);
+
+#endif
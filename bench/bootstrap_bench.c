@@ -0,0 +1,227 @@
+// bootstrap() pacing check
+// Sends each loader with "dl -b" through a pseudo-terminal, checks that
+// every byte arrives, and compares the time it takes with the old fixed
+// 8 ms per byte. A pty has no wire delay, so the wire time at the given
+// baud rate is added from the byte count.
+//
+// A .CO file goes out as the BASIC loader dl makes from it. That one is
+// checked by decoding its DATA lines the way the loader does, and
+// comparing the bytes and the checksum line with the .CO, and every line
+// has to fit in BASIC's 255 bytes.
+//
+// make && make bench && bench/bootstrap_bench [-d path/to/dl] [-s baud] [-z ms] [loader ...]
+//
+//  -d  dl executable to test (./dl)
+//  -s  baud rate for the wire time (19200)
+//  -z  passed on to dl (8)
+//  loader files default to every clients/*/*.{100,200,K85,M10,NEC,CO}
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "constants.h"
+
+#define OLD_BYTE_MS 8
+#define RX_TIMEOUT  10000 // ms
+#define CO_HEADER_LEN 6
+#define CO_MAX_LOADER (1<<20)
+#define BASIC_LINE_MAX 255
+
+static double now (void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+// what dl should send for loader f, like send_BASIC()
+static uint8_t* expected (const char* f, int* n) {
+	struct stat st;
+	uint8_t* d;
+	int h = open(f,O_RDONLY);
+	if (h<0 || fstat(h,&st) || !(d = malloc(st.st_size+2)) || read(h,d,st.st_size)!=st.st_size) return NULL;
+	close(h);
+	*n = st.st_size;
+	uint8_t b = *n ? d[*n-1] : 0x00;
+	if (b!=LOCAL_EOL && b!=BASIC_EOL && b!=BASIC_EOF) d[(*n)++] = BASIC_EOL;
+	if (b!=BASIC_EOF) d[(*n)++] = BASIC_EOF;
+	return d;
+}
+
+static int is_co (const char* f) {
+	const char* e = strrchr(f,'.');
+	return e && !strcasecmp(e,".CO");
+}
+
+// Decode the loader d of length n like its own READ loop does, into o,
+// and compare with the .CO code c of length len loaded at top.
+// NULL if it all matches, or what doesn't.
+static const char* co_mismatch (const uint8_t* d, int n, const uint8_t* c, int len, int top, uint8_t* o) {
+	static char m[80];
+	int i, j, l, ln = 0, sum = 0, got_sum = -1, first = -1, a = -1, e = -1, on = 0;
+	const char* p;
+	char b[BASIC_LINE_MAX+1];
+	long v;
+
+	if (!n || d[n-1]!=BASIC_EOF) return "no ^Z at the end";
+	for (i=0;i<n-1;i+=l+1,ln++) {
+		for (l=0;i+l<n-1 && d[i+l]!=BASIC_EOL;l++);
+		if (l>BASIC_LINE_MAX) { snprintf(m,sizeof(m),"line %d is %d bytes",ln,l); return m; }
+		memcpy(b,d+i,l);
+		b[l] = 0;
+		if ((p = strstr(b,":A="))) sscanf(p,":A=%d:E=%d",&a,&e);
+		if ((p = strstr(b,"ASC(MID$(D$,K,1))-"))) first = atoi(p+18);
+		if ((p = strstr(b,"IFS<>"))) got_sum = atoi(p+5);
+		for (p=b;*p>='0' && *p<='9';p++);
+		if (strncmp(p,"DATA",4)) continue;
+		if (first<0) return "DATA before the decoder";
+		for (p+=4;*p;p+=4) {
+			for (v=j=0;j<4;j++) {
+				if (p[j]<first || p[j]>first+63 || p[j]==',' || p[j]==':' || p[j]=='"') {
+					snprintf(m,sizeof(m),"line %d has 0x%02X in DATA",ln,(uint8_t)p[j]);
+					return m;
+				}
+				v = v*64 + p[j]-first;
+			}
+			o[on++] = v>>16; o[on++] = v>>8; o[on++] = v;
+		}
+	}
+
+	for (i=0;i<len;i++) sum += c[i];
+	if (a!=top || e!=top+len-1) snprintf(m,sizeof(m),"loads %d-%d, not %d-%d",a,e,top,top+len-1);
+	else if (on<len || on>len+2 || memcmp(o,c,len)) snprintf(m,sizeof(m),"DATA decodes to %d bytes, not the .CO's %d",on,len);
+	else if (got_sum!=sum) snprintf(m,sizeof(m),"checksum %d, the .CO adds up to %d",got_sum,sum);
+	else return NULL;
+	return m;
+}
+
+// check the loader d that dl sent for .CO file f, 0 if it matches
+static int check_co (const char* f, const uint8_t* d, int n) {
+	uint8_t h[CO_HEADER_LEN];
+	uint8_t* c = NULL;
+	uint8_t* o = malloc(n);
+	const char* m = "can't read it";
+	int fd = open(f,O_RDONLY), len;
+	if (o && fd>=0 && read(fd,h,CO_HEADER_LEN)==CO_HEADER_LEN) {
+		len = h[2]+h[3]*256;
+		if ((c = malloc(len)) && read(fd,c,len)==len) m = co_mismatch(d,n,c,len,h[0]+h[1]*256,o);
+	}
+	if (m) fprintf(stderr,"%s: %s\n",f,m);
+	if (fd>=0) close(fd);
+	free(c);
+	free(o);
+	return m ? -1 : 0;
+}
+
+// run dl -b f, return seconds, or <0 if the data didn't all arrive intact
+static double run (const char* dl, const char* z, const char* f, int* n, int* lines) {
+	int mfd, sfd, in[2], i, r;
+	const char* pts;
+	struct termios t;
+	struct pollfd pf;
+	int co = is_co(f);
+	uint8_t* d = NULL;
+	uint8_t* got;
+	double t0;
+	pid_t pid;
+
+	// the loader made from a .CO is whatever arrives up to the ^Z
+	if (co) *n = CO_MAX_LOADER;
+	else if (!(d = expected(f,n))) { fprintf(stderr,"%s: %s\n",f,strerror(errno)); return -1; }
+	if (!(got = malloc(*n))) { fprintf(stderr,"%s: %s\n",f,strerror(errno)); free(d); return -1; }
+
+	if ((mfd = posix_openpt(O_RDWR|O_NOCTTY))<0 || grantpt(mfd) || unlockpt(mfd) || !(pts = ptsname(mfd))) return -1;
+	if ((sfd = open(pts,O_RDWR|O_NOCTTY))<0) return -1;
+	tcgetattr(mfd,&t);
+	cfmakeraw(&t);
+	tcsetattr(mfd,TCSANOW,&t);
+	if (pipe(in)) return -1;
+
+	if (!(pid = fork())) {
+		int h = open("/dev/null",O_WRONLY);
+		dup2(in[0],STDIN_FILENO);
+		dup2(h,STDOUT_FILENO);
+		dup2(h,STDERR_FILENO);
+		close(in[1]);
+		close(mfd);
+		close(sfd);
+		execl(dl,dl,"-z",z,"-b",f,pts,(char*)NULL);
+		_exit(127);
+	}
+	close(in[0]);
+
+	// "Press [Enter] when ready..."
+	t0 = now();
+	if (write(in[1],"\n",1)!=1) return -1;
+
+	pf.fd = mfd;
+	pf.events = POLLIN;
+	for (i=0;i<*n;i+=r) {
+		if (poll(&pf,1,RX_TIMEOUT)<1 || (r = read(mfd,got+i,*n-i))<1) break;
+		if (co && got[i+r-1]==BASIC_EOF) { i += r; *n = i; break; }
+	}
+	t0 = now()-t0;
+
+	kill(pid,SIGTERM);
+	waitpid(pid,NULL,0);
+	close(in[1]);
+	close(mfd);
+	close(sfd);
+	if (co) r = i==*n && !check_co(f,got,*n);
+	else r = i==*n && !memcmp(got,d,*n);
+	for (i=*lines=0;i<*n;i++) if (got[i]==BASIC_EOL) (*lines)++;
+	free(got);
+	free(d);
+	return r ? t0 : -1;
+}
+
+int main (int argc, char** argv) {
+	const char* dl = "./dl";
+	const char* z = "8";
+	int baud = 19200, c, i, n, lines, bad = 0;
+	double t, wire, tt = 0, to = 0;
+	glob_t g = {0};
+
+	while ((c = getopt(argc,argv,"d:s:z:"))>=0)
+		switch (c) {
+			case 'd': dl = optarg; break;
+			case 's': baud = atoi(optarg); break;
+			case 'z': z = optarg; break;
+			default: fprintf(stderr,"usage: %s [-d path/to/dl] [-s baud] [-z ms] [loader ...]\n",argv[0]); return 1;
+		}
+	if (optind<argc) {
+		g.gl_pathv = argv+optind;
+		g.gl_pathc = argc-optind;
+	} else {
+		const char* p[] = {"clients/*/*.100","clients/*/*.200","clients/*/*.K85","clients/*/*.M10","clients/*/*.NEC","clients/*/*.CO"};
+		for (i=0;i<6;i++) glob(p[i],i?GLOB_APPEND:0,NULL,&g);
+	}
+	if (!g.gl_pathc) { fprintf(stderr,"no loaders\n"); return 1; }
+
+	printf("%s -z %s, wire time at %d baud\n\n",dl,z,baud);
+	printf("%-32s %6s %5s %8s %8s %8s %8s\n","loader","bytes","lines","pause s","wire s","total s","8ms/B s");
+	for (i=0;i<(int)g.gl_pathc;i++) {
+		const char* f = g.gl_pathv[i];
+		t = run(dl,z,f,&n,&lines);
+		wire = n*10.0/baud;
+		if (t<0) { printf("%-32s FAILED\n",f); bad++; continue; }
+		printf("%-32s %6d %5d %8.2f %8.2f %8.2f %8.2f\n",f,n,lines,t,wire,t+wire,n*(OLD_BYTE_MS/1e3+10.0/baud));
+		tt += t+wire;
+		to += n*(OLD_BYTE_MS/1e3+10.0/baud);
+	}
+	printf("\ntotal %.1f s, %.1f s at %d ms per byte, %.1fx\n",tt,to,OLD_BYTE_MS,tt>0?to/tt:0);
+	return bad!=0;
+}
@@ -0,0 +1,67 @@
+// dir_list microbenchmark
+// insert N entries, then look each one up by name, plus N misses
+//
+// make bench && bench/dir_list_bench [N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dir_list.h"
+
+static double now (void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+int main (int argc, char** argv) {
+	int n = argc>1 ? atoi(argv[1]) : 100000;
+	int i, found = 0;
+	char name[TPDD_FILENAME_LEN+1];
+	FILE_LIST l = {0};
+	FILE_ENTRY f;
+	double t;
+
+	memset(&f,0,sizeof(f));
+	f.attr = 'F';
+	if (file_list_init(&l)) return 1;
+
+	t = now();
+	for (i=0;i<n;i++) {
+		snprintf(f.client_fname,sizeof(f.client_fname),"F%05X.DO",i);
+		snprintf(f.local_fname,sizeof(f.local_fname),"file_%d.do",i);
+		if (add_file(&l,&f)) { fprintf(stderr,"add_file failed at %d\n",i); return 1; }
+	}
+	t = now()-t;
+	printf("insert  %d: %.3f s  %.0f ns/entry\n",n,t,t*1e9/n);
+
+	t = now();
+	for (i=0;i<n;i++) {
+		snprintf(name,sizeof(name),"F%05X.DO",i);
+		if (find_file(&l,name,'F')) found++;
+	}
+	t = now()-t;
+	printf("hit     %d: %.3f s  %.0f ns/lookup  (%d found)\n",n,t,t*1e9/n,found);
+
+	found = 0;
+	t = now();
+	for (i=0;i<n;i++) {
+		snprintf(name,sizeof(name),"G%05X.DO",i);
+		if (find_file(&l,name,'F')) found++;
+	}
+	t = now()-t;
+	printf("miss    %d: %.3f s  %.0f ns/lookup  (%d found)\n",n,t,t*1e9/n,found);
+
+	// ordering must be the insertion order
+	i = 0;
+	for (FILE_ENTRY* e=get_first_file(&l); e; e=get_next_file(&l), i++) {
+		snprintf(name,sizeof(name),"F%05X.DO",i);
+		if (strcmp(name,e->client_fname)) { fprintf(stderr,"order broken at %d\n",i); return 1; }
+	}
+	if (i!=n) { fprintf(stderr,"walked %d of %d\n",i,n); return 1; }
+
+	file_list_cleanup(&l);
+	return 0;
+}
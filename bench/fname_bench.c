@@ -0,0 +1,67 @@
+// make_file_entry() microbenchmark
+// translate N local filenames with every profile in CLIENT_PROFILES,
+// the first pass through the name cache (all misses), then R more passes
+// (hits, unless two names share a slot)
+//
+// make bench && bench/fname_bench [N] [R]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "constants.h"
+#include "tpdd.h"
+
+static const CLIENT_PROFILE profiles[] = CLIENT_PROFILES ;
+
+static double now (void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+int main (int argc, char** argv) {
+	int n = argc>1 ? atoi(argv[1]) : DIRENTS;
+	int r = argc>2 ? atoi(argv[2]) : 10000;
+	const int np = sizeof(profiles)/sizeof(profiles[0]);
+	char (*names)[LOCAL_FILENAME_MAX+1] = calloc(n,LOCAL_FILENAME_MAX+1);
+	FILE_ENTRY f;
+	double t0, t1;
+	int i, j, p;
+
+	if (!names) return 1;
+	// a mix of what turns up in a share: short, long, no ext, dirs
+	for (i=0;i<n;i++) switch (i%4) {
+		case 0: snprintf(names[i],LOCAL_FILENAME_MAX+1,"FILE%d.DO",i); break;
+		case 1: snprintf(names[i],LOCAL_FILENAME_MAX+1,"some_longer_name_%d.txt",i); break;
+		case 2: snprintf(names[i],LOCAL_FILENAME_MAX+1,"README%d",i); break;
+		case 3: snprintf(names[i],LOCAL_FILENAME_MAX+1,"dir.%d",i); break;
+	}
+
+	printf("%-8s %10s %10s   %d names, %d passes\n","profile","miss_ns","hit_ns",n,r);
+	for (p=0;p<np;p++) {
+		base_len = profiles[p].base;
+		ext_len = profiles[p].ext;
+		pad_fn = profiles[p].pad;
+		dme_en = profiles[p].dme;
+		upcase = profiles[p].upcase;
+		cfnl = base_len+1+ext_len; // like main()
+		if (base_len<1||cfnl>TPDD_FILENAME_LEN) cfnl = TPDD_FILENAME_LEN;
+		make_file_entry(&f,"x",ATTR_DEF,0,FE_FLAGS_NONE); // drops the cache, not timed
+
+		t0 = now();
+		for (i=0;i<n;i++) make_file_entry(&f,names[i],ATTR_DEF,1000,i%4==3?FE_FLAGS_DIR:FE_FLAGS_NONE);
+		t0 = now()-t0;
+
+		t1 = now();
+		for (j=0;j<r;j++)
+			for (i=0;i<n;i++) make_file_entry(&f,names[i],ATTR_DEF,1000,i%4==3?FE_FLAGS_DIR:FE_FLAGS_NONE);
+		t1 = now()-t1;
+
+		printf("%-8s %10.0f %10.0f\n",profiles[p].id,t0*1e9/n,t1*1e9/n/r);
+	}
+
+	free(names);
+	return 0;
+}
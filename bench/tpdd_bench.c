@@ -0,0 +1,560 @@
+// TPDD client workload benchmark
+// Runs dl on the slave side of a pseudo-terminal and plays scripted client
+// requests on the master side, timing every request from the first byte
+// sent to the last byte of the response.
+//
+// make && make bench && bench/tpdd_bench [-d path/to/dl] [-n #] [-v]
+//
+//  -d  dl executable to test (./dl)
+//  -n  how many times to repeat each workload (20)
+//  -v  leave dl's output on stderr instead of discarding it
+//
+// Workloads:
+//  dirent  TS-DOS style directory listing of 100 files, first & next
+//  load    open, read, and close a 64K file
+//  save    open, write, and close a 64K file, then delete it
+//  fdc     format, then read & write every sector in FDC mode
+//  tpdd2   cache load and mem_read of every sector of a TPDD2 disk image
+//  image   save files inside a disk image from a -L library, and change the
+//          disk through DISK_SOCKET, once with a file still open for write
+//  overlay save, load, and delete a file inside a disk image, with -o
+//
+// Prints the latency percentiles of every request type, and the
+// throughput of the data each workload moved.
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "constants.h"
+
+#define LIST_FILES 100
+#define BIG_LEN    65536
+#define RX_TIMEOUT 5000 // ms
+#define MAX_OPS    24
+#define IMG_WRITES 8    // packets per file saved in a disk image
+
+typedef struct {
+	char    name[16];
+	double* t;  // latency samples in us
+	int     n;
+	int     max;
+} OP_STATS;
+
+static OP_STATS ops[MAX_OPS];
+static int nops = 0;
+static int mfd = -1;       // pty master, the client side
+static int sfd = -1;       // pty slave, kept open so mfd never sees a hangup before dl opens it
+static pid_t dl_pid = -1;
+static bool verbose = false;
+static char tmp_dir[] = "/tmp/tpdd_bench.XXXXXX";
+static struct sockaddr_un disk_sock = { .sun_family = AF_UNIX };
+static uint8_t b[TPDD_MSG_MAX+3];
+
+static double now (void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e6 + t.tv_nsec/1e3;
+}
+
+static void fail (const char* f, ...) __attribute__ ((format (printf, 1, 2), noreturn));
+static void fail (const char* f, ...) {
+	va_list a;
+	va_start(a,f);
+	vfprintf(stderr,f,a);
+	va_end(a);
+	fputc('\n',stderr);
+	if (dl_pid>0) kill(dl_pid,SIGKILL);
+	exit(1);
+}
+
+static void sample (const char* op, double t0) {
+	double t = now()-t0;
+	int i;
+	for (i=0;i<nops && strcmp(ops[i].name,op);i++);
+	if (i==nops) {
+		if (nops==MAX_OPS) fail("too many op types");
+		snprintf(ops[nops++].name,sizeof(ops[i].name),"%s",op);
+	}
+	OP_STATS* s = &ops[i];
+	if (s->n==s->max) {
+		s->max = s->max ? s->max*2 : 1024;
+		if (!(s->t = realloc(s->t,s->max*sizeof(double)))) fail("%s",strerror(errno));
+	}
+	s->t[s->n++] = t;
+}
+
+/* client side i/o */
+
+static void tx (const void* p, int n) {
+	if (write(mfd,p,n)!=n) fail("write: %s",strerror(errno));
+}
+
+// read exactly n bytes
+static void rx (void* p, int n) {
+	struct pollfd pf = { .fd = mfd, .events = POLLIN };
+	int i;
+	while (n>0) {
+		if (poll(&pf,1,RX_TIMEOUT)<1) fail("timed out waiting for %d bytes",n);
+		if ((i = read(mfd,p,n))<1) fail("read: %s",i?strerror(errno):"eof");
+		p = (uint8_t*)p+i;
+		n -= i;
+	}
+}
+
+// discard anything that arrives within ms
+static void drain (int ms) {
+	struct pollfd pf = { .fd = mfd, .events = POLLIN };
+	uint8_t t[256];
+	while (poll(&pf,1,ms)>0 && read(mfd,t,sizeof(t))>0);
+}
+
+static uint8_t checksum (const uint8_t* p, int n) {
+	uint16_t s = 0;
+	while (n--) s += *p++;
+	return ~s & 0xFF;
+}
+
+// send an Operation-mode request
+static void req (uint8_t fmt, const void* p, uint8_t n) {
+	uint8_t f[TPDD_MSG_MAX+3] = {'Z','Z',fmt,n};
+	memcpy(f+4,p,n);
+	f[4+n] = checksum(f+2,n+2);
+	tx(f,n+5);
+}
+
+// read an Operation-mode response into b[], return the error byte
+static uint8_t ret (uint8_t fmt) {
+	rx(b,2);
+	rx(b+2,b[1]+1);
+	if (b[0]!=fmt) fail("response 0x%02X, expected 0x%02X",b[0],fmt);
+	if (b[2+b[1]]!=checksum(b,b[1]+2)) fail("bad checksum on response 0x%02X",fmt);
+	return b[2];
+}
+
+static uint8_t opr_std (const char* op, uint8_t fmt, const void* p, uint8_t n) {
+	double t = now();
+	req(fmt,p,n);
+	uint8_t e = ret(RET_STD[0]);
+	sample(op,t);
+	return e;
+}
+
+// dirent request, returns the name in the response
+static char* dirent (const char* name, uint8_t action) {
+	uint8_t p[TPDD_FILENAME_LEN+2];
+	static char r[TPDD_FILENAME_LEN+1];
+	double t = now();
+	memset(p,' ',TPDD_FILENAME_LEN);
+	memcpy(p,name,strlen(name));
+	p[TPDD_FILENAME_LEN] = 'F';
+	p[TPDD_FILENAME_LEN+1] = action;
+	req(REQ_DIRENT,p,sizeof(p));
+	ret(RET_DIRENT[0]);
+	sample("dirent",t);
+	memcpy(r,b+2,TPDD_FILENAME_LEN);
+	r[TPDD_FILENAME_LEN] = 0x00;
+	return r;
+}
+
+// FDC-mode command, returns the response error code
+static int fdc (const char* op, const char* cmd) {
+	char r[9] = {0};
+	double t = now();
+	tx(cmd,strlen(cmd));
+	rx(r,8);
+	sample(op,t);
+	return strtol((char[3]){r[0],r[1],0},NULL,16);
+}
+
+/* dl */
+
+static void start_dl (const char* dl, const char* const* opts) {
+	char* args[16];
+	const char* pts;
+	int i = 0;
+	struct termios t;
+
+	if ((mfd = posix_openpt(O_RDWR|O_NOCTTY))<0 || grantpt(mfd) || unlockpt(mfd) || !(pts = ptsname(mfd)))
+		fail("pty: %s",strerror(errno));
+
+	// raw before dl opens it, so nothing sent early gets cooked
+	if ((sfd = open(pts,O_RDWR|O_NOCTTY))<0) fail("%s: %s",pts,strerror(errno));
+	tcgetattr(sfd,&t);
+	cfmakeraw(&t);
+	tcsetattr(sfd,TCSANOW,&t);
+	tcgetattr(mfd,&t);
+	cfmakeraw(&t);
+	tcsetattr(mfd,TCSANOW,&t);
+
+	args[i++] = (char*)dl;
+	while (*opts) args[i++] = (char*)*opts++;
+	args[i++] = (char*)pts;
+	args[i] = NULL;
+
+	if ((dl_pid = fork())<0) fail("fork: %s",strerror(errno));
+	if (!dl_pid) {
+		close(mfd);
+		close(sfd);
+		if (!verbose) {
+			int h = open("/dev/null",O_WRONLY);
+			dup2(h,STDERR_FILENO);
+			dup2(h,STDOUT_FILENO);
+		}
+		execv(dl,args);
+		_exit(127);
+	}
+}
+
+// wait until dl answers
+static void wait_dl (bool fdc_mode) {
+	struct pollfd pf = { .fd = mfd, .events = POLLIN };
+	for (int i=0;i<50;i++) {
+		if (fdc_mode) tx("D\r",2);
+		else req(REQ_STATUS,NULL,0);
+		if (poll(&pf,1,100)>0) { drain(200); return; }
+	}
+	fail("no response from dl");
+}
+
+static void stop_dl (void) {
+	kill(dl_pid,SIGTERM);
+	waitpid(dl_pid,NULL,0);
+	close(mfd);
+	close(sfd);
+	dl_pid = -1;
+	mfd = sfd = -1;
+}
+
+/* workloads */
+
+static void w_dirent (void) {
+	int n = 0;
+	dirent("",DIRENT_SET_NAME);
+	for (char* r=dirent("",DIRENT_GET_FIRST); r[0]; r=dirent("",DIRENT_GET_NEXT)) n++;
+	if (n!=LIST_FILES+1) fail("listed %d files, expected %d",n,LIST_FILES+1);
+}
+
+static long w_load (void) {
+	long n = 0;
+	uint8_t m = F_OPEN_READ;
+	double t;
+	dirent("BIG   .CO",DIRENT_SET_NAME);
+	if (opr_std("open",REQ_OPEN,&m,1)) fail("open BIG.CO for reading failed");
+	do {
+		t = now();
+		req(REQ_READ,NULL,0);
+		ret(RET_READ);
+		sample("read",t);
+		n += b[1];
+	} while (b[1]==REQ_RW_DATA_MAX);
+	if (opr_std("close",REQ_CLOSE,NULL,0)) fail("close failed");
+	if (n!=BIG_LEN) fail("read %ld bytes, expected %d",n,BIG_LEN);
+	return n;
+}
+
+static long w_save (void) {
+	uint8_t d[REQ_RW_DATA_MAX];
+	uint8_t m = F_OPEN_WRITE;
+	long n;
+	memset(d,'S',sizeof(d));
+	dirent("SAVE  .CO",DIRENT_SET_NAME);
+	if (opr_std("open",REQ_OPEN,&m,1)) fail("open SAVE.CO for writing failed");
+	for (n=0;n<BIG_LEN;n+=sizeof(d))
+		if (opr_std("write",REQ_WRITE,d,sizeof(d))) fail("write failed at %ld",n);
+	if (opr_std("close",REQ_CLOSE,NULL,0)) fail("close failed");
+	dirent("SAVE  .CO",DIRENT_SET_NAME);
+	if (opr_std("delete",REQ_DELETE,NULL,0)) fail("delete failed");
+	return n;
+}
+
+static long w_fdc (void) {
+	char c[16];
+	uint8_t d[SECTOR_DATA_LEN];
+	long n = 0;
+	int p, e;
+	double t;
+
+	// one 1280 byte logical sector per physical sector
+	if ((e = fdc("F",(char[4]){FDC_FORMAT,'6',FDC_CMD_EOL,0}))) fail("format: error 0x%02X",e);
+
+	memset(d,'W',sizeof(d));
+	for (p=0;p<PDD1_TRACKS*PDD1_SECTORS;p++) {
+		snprintf(c,sizeof(c),"%c%d,1\r",FDC_WRITE_SECTOR,p);
+		t = now();
+		tx(c,strlen(c));
+		rx(c,8);
+		if (strncmp(c,"00",2)) fail("write sector %d: %.8s",p,c);
+		tx(d,sizeof(d));
+		rx(c,8);
+		if (strncmp(c,"00",2)) fail("write sector %d: %.8s",p,c);
+		sample("W",t);
+		n += sizeof(d);
+	}
+
+	for (p=0;p<PDD1_TRACKS*PDD1_SECTORS;p++) {
+		snprintf(c,sizeof(c),"%c%d,1\r",FDC_READ_SECTOR,p);
+		t = now();
+		tx(c,strlen(c));
+		rx(c,8);
+		if (strncmp(c,"00",2)) fail("read sector %d: %.8s",p,c);
+		tx((char[1]){FDC_CMD_EOL},1);
+		rx(d,sizeof(d));
+		sample("R",t);
+		n += sizeof(d);
+	}
+	return n;
+}
+
+static long w_tpdd2 (void) {
+	uint8_t p[5] = {0};
+	long n = 0;
+	int o, l;
+	double t;
+
+	for (int rn=0;rn<PDD2_TRACKS*PDD2_SECTORS;rn++) {
+		p[0] = CACHE_LOAD;
+		p[2] = rn/PDD2_SECTORS;
+		p[4] = rn%PDD2_SECTORS;
+		t = now();
+		req(REQ_CACHE,p,5);
+		if (ret(RET_CACHE[0])) fail("cache load %d failed",rn);
+		sample("cache",t);
+
+		for (o=0;o<SECTOR_DATA_LEN;o+=l) {
+			l = SECTOR_DATA_LEN-o;
+			if (l>PDD2_MEM_READ_MAX) l = PDD2_MEM_READ_MAX;
+			p[0] = MEM_CACHE;
+			p[1] = o>>8;
+			p[2] = o&0xFF;
+			p[3] = l;
+			t = now();
+			req(REQ_MEM_READ,p,4);
+			ret(RET_MEM_READ);
+			sample("mem_read",t);
+			if (b[1]!=3+l) fail("mem_read returned %d bytes, expected %d",b[1]-3,l);
+			n += l;
+		}
+	}
+	return n;
+}
+
+// change the disk to library image name through DISK_SOCKET
+static void change_disk (const char* name) {
+	char r[PATH_MAX+16];
+	int h, n = 0, i;
+	double t = now();
+	if ((h = socket(AF_UNIX,SOCK_STREAM,0))<0 || connect(h,(struct sockaddr*)&disk_sock,sizeof(disk_sock)))
+		fail("%s: %s",disk_sock.sun_path,strerror(errno));
+	snprintf(r,sizeof(r),"%s\n",name);
+	if (write(h,r,strlen(r))<0) fail("%s: %s",disk_sock.sun_path,strerror(errno));
+	while (n<(int)sizeof(r)-1 && (i = read(h,r+n,sizeof(r)-1-n))>0) n += i;
+	close(h);
+	r[n] = 0x00;
+	sample("change",t);
+	if (strncmp(r,"OK ",3)) fail("change to %s: %s",name,r);
+}
+
+// open name for writing in the current disk, and write n packets to it
+static long save_open (const char* name, int n) {
+	uint8_t d[REQ_RW_DATA_MAX];
+	uint8_t m = F_OPEN_WRITE, e;
+	long l = 0;
+	memset(d,'I',sizeof(d));
+	dirent(name,DIRENT_SET_NAME);
+	if ((e = opr_std("open",REQ_OPEN,&m,1))) fail("open %s for writing failed: %02X",name,e);
+	for (;n>0;n--,l+=sizeof(d))
+		if (opr_std("write",REQ_WRITE,d,sizeof(d))) fail("write failed at %ld",l);
+	return l;
+}
+
+static long w_image (void) {
+	static bool formatted = false;
+	long n;
+
+	if (!formatted) {
+		change_disk("B.pdd1");
+		if (opr_std("format",REQ_FORMAT,NULL,0)) fail("format B.pdd1 failed");
+		change_disk("A.pdd1");
+		if (opr_std("format",REQ_FORMAT,NULL,0)) fail("format A.pdd1 failed");
+		formatted = true;
+	}
+
+	n = save_open("IMG   .DO",IMG_WRITES);
+	if (opr_std("close",REQ_CLOSE,NULL,0)) fail("close failed");
+
+	// Change the disk under a file that's open for writing. Any write still
+	// buffered is lost, so the close may fail, but it has to be answered.
+	n += save_open("CHG   .DO",1);
+	change_disk("B.pdd1");
+	opr_std("close",REQ_CLOSE,NULL,0);
+
+	change_disk("A.pdd1");
+	dirent("IMG   .DO",DIRENT_SET_NAME);
+	if (opr_std("delete",REQ_DELETE,NULL,0)) fail("delete failed");
+	dirent("CHG   .DO",DIRENT_SET_NAME);
+	if (opr_std("delete",REQ_DELETE,NULL,0)) fail("delete failed");
+	return n;
+}
+
+static long w_overlay (void) {
+	uint8_t m = F_OPEN_READ;
+	long n = save_open("OVL   .DO",IMG_WRITES), r = 0;
+	double t;
+	if (opr_std("close",REQ_CLOSE,NULL,0)) fail("close failed");
+	dirent("OVL   .DO",DIRENT_SET_NAME);
+	if (opr_std("open",REQ_OPEN,&m,1)) fail("open OVL.DO for reading failed");
+	do {
+		t = now();
+		req(REQ_READ,NULL,0);
+		ret(RET_READ);
+		sample("read",t);
+		r += b[1];
+	} while (b[1]==REQ_RW_DATA_MAX);
+	if (opr_std("close",REQ_CLOSE,NULL,0)) fail("close failed");
+	if (r!=n) fail("read %ld bytes, expected %ld",r,n);
+	dirent("OVL   .DO",DIRENT_SET_NAME);
+	if (opr_std("delete",REQ_DELETE,NULL,0)) fail("delete failed");
+	return n+r;
+}
+
+/* setup & report */
+
+static void make_file (const char* name, long len) {
+	char p[PATH_MAX+1];
+	snprintf(p,sizeof(p),"%s/share/%s",tmp_dir,name);
+	FILE* f = fopen(p,"w");
+	if (!f) fail("%s: %s",p,strerror(errno));
+	while (len--) fputc('A'+len%26,f);
+	fclose(f);
+}
+
+// blank disk image
+static void make_img (const char* p, long len) {
+	int h = open(p,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if (h<0 || ftruncate(h,len)) fail("%s: %s",p,strerror(errno));
+	close(h);
+}
+
+static int cmp (const void* a, const void* b) {
+	double d = *(const double*)a - *(const double*)b;
+	return (d>0)-(d<0);
+}
+
+static double pct (OP_STATS* s, int p) {
+	return s->t[(s->n-1)*p/100];
+}
+
+static void report (const char* w, long bytes, double us) {
+	int i;
+	printf("\n%s",w);
+	if (bytes) printf(": %ld bytes in %.3f s, %.1f KB/s",bytes,us/1e6,bytes/us*1e6/1024);
+	printf("\n  %-10s %8s %10s %10s %10s %10s\n","request","n","p50 us","p90 us","p99 us","max us");
+	for (i=0;i<nops;i++) {
+		OP_STATS* s = &ops[i];
+		qsort(s->t,s->n,sizeof(double),cmp);
+		printf("  %-10s %8d %10.1f %10.1f %10.1f %10.1f\n",s->name,s->n,pct(s,50),pct(s,90),pct(s,99),s->t[s->n-1]);
+		free(s->t);
+	}
+	memset(ops,0,sizeof(ops));
+	nops = 0;
+}
+
+typedef struct {
+	const char* name;
+	long (*run)(void);
+	bool fdc_mode;
+	const char* opts[10];
+} WORKLOAD;
+
+static long run_dirent (void) { w_dirent(); return 0; }
+
+int main (int argc, char** argv) {
+	const char* dl = "./dl";
+	char share[PATH_MAX+1], img1[PATH_MAX+1], img2[PATH_MAX+1], t[32];
+	char lib[PATH_MAX-16], lib_a[PATH_MAX+1], lib_b[PATH_MAX+1], ovl[PATH_MAX+1];
+	int i, c, reps = 20;
+	long bytes;
+	double us;
+
+	while ((c = getopt(argc,argv,"d:n:v"))>=0)
+		switch (c) {
+			case 'd': dl = optarg; break;
+			case 'n': reps = atoi(optarg); break;
+			case 'v': verbose = true; break;
+			default: fprintf(stderr,"usage: %s [-d path/to/dl] [-n #] [-v]\n",argv[0]); return 1;
+		}
+	if (access(dl,X_OK)) fail("%s: %s",dl,strerror(errno));
+	if (reps<1) reps = 1;
+
+	if (!mkdtemp(tmp_dir)) fail("%s: %s",tmp_dir,strerror(errno));
+	snprintf(share,sizeof(share),"%s/share",tmp_dir);
+	snprintf(img1,sizeof(img1),"%s/bench.pdd1",tmp_dir);
+	snprintf(img2,sizeof(img2),"%s/bench.pdd2",tmp_dir);
+	if (mkdir(share,0755)) fail("%s: %s",share,strerror(errno));
+	for (i=0;i<LIST_FILES;i++) {
+		snprintf(t,sizeof(t),"F%05d.DO",i);
+		make_file(t,100);
+	}
+	make_file("BIG.CO",BIG_LEN);
+	make_img(img1,PDD1_IMG_LEN);
+	make_img(img2,PDD2_IMG_LEN);
+
+	// -L library of two blank disks, formatted by the image workload,
+	// then A.pdd1 is the base image for the overlay workload
+	snprintf(lib,sizeof(lib),"%s/lib",tmp_dir);
+	snprintf(lib_a,sizeof(lib_a),"%s/A.pdd1",lib);
+	snprintf(ovl,sizeof(ovl),"%s/ovl",tmp_dir);
+	snprintf(disk_sock.sun_path,sizeof(disk_sock.sun_path),"%s/disk.sock",tmp_dir);
+	if (mkdir(lib,0755) || mkdir(ovl,0755)) fail("%s: %s",tmp_dir,strerror(errno));
+	make_img(lib_a,PDD1_IMG_LEN);
+	snprintf(lib_b,sizeof(lib_b),"%s/B.pdd1",lib);
+	make_img(lib_b,PDD1_IMG_LEN);
+
+	const WORKLOAD w[] = {
+		{ "dirent", run_dirent, false, { "-p", share, NULL } },
+		{ "load",   w_load,     false, { "-p", share, NULL } },
+		{ "save",   w_save,     false, { "-p", share, NULL } },
+		{ "fdc",    w_fdc,      true,  { "-p", share, "-f", "-i", img1, NULL } },
+		{ "tpdd2",  w_tpdd2,    false, { "-p", share, "-m", "2", "-i", img2, NULL } },
+		{ "image",  w_image,    false, { "-p", share, "-L", lib, "-i", lib_a, NULL } },
+		{ "overlay",w_overlay,  false, { "-p", share, "-i", lib_a, "-o", ovl, NULL } },
+	};
+
+	printf("%s, %d reps, %d files listed, %d byte file\n",dl,reps,LIST_FILES,BIG_LEN);
+	for (i=0;i<(int)(sizeof(w)/sizeof(w[0]));i++) {
+		int j;
+		if (w[i].run==w_image) setenv("DISK_SOCKET",disk_sock.sun_path,1);
+		else unsetenv("DISK_SOCKET");
+		start_dl(dl,w[i].opts);
+		wait_dl(w[i].fdc_mode);
+		bytes = 0;
+		us = now();
+		for (j=0;j<reps;j++) bytes += w[i].run();
+		us = now()-us;
+		stop_dl();
+		report(w[i].name,bytes,us);
+	}
+
+	snprintf(t,sizeof(t),"rm -rf %s",tmp_dir);
+	if (system(t)) return 1;
+	return 0;
+}
@@ -0,0 +1,193 @@
+// Session capture and replay
+//
+// With a capture file open, everything a session receives and sends is
+// recorded as it goes through rx_fill() and write_client_tty(), in the
+// chunks it was actually read and written in, with a timestamp and the
+// mode it was in at the time.
+//
+// File format, all numbers little-endian:
+//   header  "DLCAP" version model mode
+//   records kind, us since the previous record (4 bytes), length (2 bytes), data
+//
+// replay() runs a capture back through serve_client() with no tty, over a
+// socketpair(), as fast as it will go. The received data is fed in, and
+// what comes back must be byte for byte what was sent the first time.
+// The share path and disk image have to be in the same state as when the
+// capture was made, and the options the same.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "tpdd.h"
+#include "capture.h"
+
+int capture_open(SESSION* ses, const char* f) {
+	uint8_t h[CAP_HEADER_LEN] = CAP_MAGIC;
+	h[5] = CAP_VERSION;
+	h[6] = model;
+	h[7] = ses->operation_mode;
+	ses->cap_fd = open(f,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0666);
+	if (ses->cap_fd<0 || write(ses->cap_fd,h,CAP_HEADER_LEN)!=CAP_HEADER_LEN) {
+		dbg(0,"Capture \"%s\": %s\n",f,strerror(errno));
+		capture_close(ses);
+		return -1;
+	}
+	ses->cap_us = 0;
+	dbg(1,"Capturing %s to \"%s\"\n",ses->tty_name,f);
+	return 0;
+}
+
+void capture_put(SESSION* ses, uint8_t kind, const void* b, int n) {
+	uint8_t r[CAP_REC_LEN];
+	struct iovec v[2] = {{r,CAP_REC_LEN},{(void*)b,0}};
+	long t, d;
+	int i;
+	if (ses->cap_fd<0) return;
+	if (ses->operation_mode==MODE_FDC) kind |= CAP_FDC;
+	t = now_us();
+	d = ses->cap_us ? t-ses->cap_us : 0;
+	if (d>UINT32_MAX) d = UINT32_MAX;
+	ses->cap_us = t;
+	while (n>0) {
+		i = n>UINT16_MAX ? UINT16_MAX : n;
+		r[0] = kind;
+		r[1] = d; r[2] = d>>8; r[3] = d>>16; r[4] = d>>24;
+		r[5] = i; r[6] = i>>8;
+		v[1].iov_len = i;
+		if (writev(ses->cap_fd,v,2)!=CAP_REC_LEN+i) {
+			dbg(0,"Capture: %s\n",strerror(errno));
+			capture_close(ses);
+			return;
+		}
+		v[1].iov_base = (uint8_t*)v[1].iov_base+i;
+		n -= i;
+		d = 0;
+	}
+}
+
+void capture_close(SESSION* ses) {
+	if (ses->cap_fd>=0) close(ses->cap_fd);
+	ses->cap_fd = -1;
+}
+
+static void* replay_serve(void* arg) {
+	SESSION* ses = arg;
+	serve_client(ses);
+	shutdown(ses->tty_fd,SHUT_WR); // let replay() see the end
+	return NULL;
+}
+
+// read n bytes from fd into b, waiting up to REPLAY_WAIT_MS for each bit
+static int replay_read(int fd, uint8_t* b, int n) {
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	int i, t = 0;
+	while (t<n) {
+		i = poll(&p,1,REPLAY_WAIT_MS);
+		if (i<0 && errno==EINTR) continue; // SIGIO from dir_cache.c
+		if (i<1 || (i = read(fd,b+t,n-t))<1) break;
+		t += i;
+	}
+	return t;
+}
+
+// Feed capture f to ses, which must not have a tty_fd yet,
+// and check the responses. Returns 0 if they all matched.
+int replay(SESSION* ses, const char* f) {
+	struct stat st;
+	uint8_t* c = NULL;
+	uint8_t* got = NULL;
+	unsigned long in = 0, out = 0, bad = 0, cap_us = 0, o;
+	int fd, sv[2], n, i, k, nr = 0, ns = 0;
+	pthread_t t;
+	long t0;
+
+	if ((fd = open(f,O_RDONLY))<0 || fstat(fd,&st) || !(c = malloc(st.st_size+1))
+		|| read(fd,c,st.st_size)!=st.st_size) {
+		dbg(0,"Replay \"%s\": %s\n",f,strerror(errno));
+		if (fd>=0) close(fd);
+		free(c);
+		return 1;
+	}
+	close(fd);
+	if (st.st_size<CAP_HEADER_LEN || memcmp(c,CAP_MAGIC,5) || c[5]!=CAP_VERSION) {
+		dbg(0,"Replay \"%s\": not a capture file\n",f);
+		free(c);
+		return 1;
+	}
+	if (c[6]!=model) {
+		dbg(0,"Replay \"%s\": captured in TPDD%d mode, use -m %d\n",f,c[6],c[6]);
+		free(c);
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) || !(got = malloc(UINT16_MAX))) {
+		dbg(0,"Replay: %s\n",strerror(errno));
+		free(c);
+		return 1;
+	}
+	ses->tty_fd = sv[0];
+	strncpy(ses->tty_name,f,PATH_MAX);
+	ses->operation_mode = c[7];
+	ses->stall_ms = REPLAY_WAIT_MS; // so that the end of the capture closes the session
+	dbg(0,"Replaying \"%s\"\n",f);
+
+	t0 = now_us();
+	if (pthread_create(&t,NULL,replay_serve,ses)) {
+		dbg(0,"Replay: can not start thread\n");
+		free(c); free(got);
+		return 1;
+	}
+
+	for (o=CAP_HEADER_LEN;o+CAP_REC_LEN<=(unsigned long)st.st_size;o+=CAP_REC_LEN+n) {
+		k = c[o];
+		cap_us += c[o+1] | c[o+2]<<8 | c[o+3]<<16 | (unsigned long)c[o+4]<<24;
+		n = c[o+5] | c[o+6]<<8;
+		if (o+CAP_REC_LEN+n>(unsigned long)st.st_size) { dbg(0,"Replay: capture is cut short\n"); bad++; break; }
+		if (!(k&CAP_SENT)) {
+			// received by the server, send it again
+			if (write(sv[1],c+o+CAP_REC_LEN,n)!=n) { dbg(0,"Replay: %s\n",strerror(errno)); bad++; break; }
+			nr++;
+			in += n;
+			continue;
+		}
+		// sent by the server, it has to send it again
+		ns++;
+		out += n;
+		i = replay_read(sv[1],got,n);
+		if (i==n && !memcmp(got,c+o+CAP_REC_LEN,n)) continue;
+		bad++;
+		dbg(0,"Replay: %s response %d differs, at byte %lu of the capture\n",k&CAP_FDC?"FDC":"Operation-mode",ns,o);
+		dbg(1,"expected: "); dbg_b(1,c+o+CAP_REC_LEN,n);
+		dbg(1,"got:      "); dbg_b(1,got,i);
+		if (i<n) break; // no response, the rest would just time out
+	}
+
+	// the server may not send anything more
+	shutdown(sv[1],SHUT_WR);
+	while ((i = replay_read(sv[1],got,UINT16_MAX))>0) {
+		bad++;
+		dbg(0,"Replay: %d bytes more than in the capture\n",i);
+		dbg_b(1,got,i);
+	}
+	pthread_join(t,NULL);
+	t0 = now_us()-t0;
+	close(sv[1]);
+	close(sv[0]);
+	ses->tty_fd = -1;
+
+	dbg(0,"%d received (%lu bytes), %d sent (%lu bytes)\n",nr,in,ns,out);
+	dbg(0,"Captured in %.3f s, replayed in %.3f s\n",cap_us/1e6,t0/1e6);
+	dbg(0,"%s\n",bad?"FAILED":"OK, all responses identical");
+	free(c);
+	free(got);
+	return bad!=0;
+}
@@ -0,0 +1,27 @@
+// Session capture and replay, see capture.c
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include "tpdd.h"
+
+#define CAP_MAGIC     "DLCAP"
+#define CAP_VERSION   1
+#define CAP_HEADER_LEN 8  // magic, version, model, operation mode at the start
+#define CAP_REC_LEN   7   // kind, 4 bytes us since the last record, 2 bytes length
+
+// record kind bits
+#define CAP_SENT      0x01 // else received
+#define CAP_FDC       0x02 // in FDC mode, else Operation mode
+
+// how long replay waits for a response, ms
+#define REPLAY_WAIT_MS 5000
+
+int  capture_open (SESSION* ses, const char* f);
+void capture_put (SESSION* ses, uint8_t kind, const void* b, int n);
+void capture_close (SESSION* ses);
+
+int  replay (SESSION* ses, const char* f);
+
+#endif
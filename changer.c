@@ -0,0 +1,129 @@
+// Disk changer
+//
+// With -L, every image in the library is already in memory, so changing
+// the disk is just pointing the drive at a different one, see
+// disk_change(). This serves a unix socket to do that while dl keeps
+// running and the ttys stay open. Each connection sends one line:
+//
+//   name     insert library image name, a file name in the -L directory
+//            or a path, and answer "OK <path>" or the error
+//   (empty)  list the library, with "*" on the disk in the drive
+//
+// eg:
+//   echo DISK2.pdd1 | nc -U /tmp/dl.disk
+//
+// Every session then reports the disk changed condition, the same as a
+// real drive when the disk is swapped, the next time the client asks.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tpdd.h"
+#include "img_store.h"
+#include "changer.h"
+
+#define CHANGER_WAIT_MS 1000 // for the client to send its line
+
+static char chg_sock[PATH_MAX+1];
+static char chg_lib[PATH_MAX+1];
+static int chg_sync;
+static int chg_fd = -1;
+static pthread_t chg_thread;
+
+// read one line from h into b, without the line ending
+static int chg_line(int h, char* b, int n) {
+	struct pollfd p = { .fd = h, .events = POLLIN };
+	int l = 0, r;
+	while (l<n-1 && poll(&p,1,CHANGER_WAIT_MS)>0 && (r = read(h,b+l,n-1-l))>0) {
+		l += r;
+		if (memchr(b,'\n',l)) break;
+	}
+	b[l] = 0x00;
+	b[strcspn(b,"\r\n")] = 0x00;
+	return l;
+}
+
+static void chg_request(FILE* f, char* b) {
+	char p[2*PATH_MAX+2], d[PATH_MAX+1];
+	STORE_IMG* s;
+	if (!*b) {
+		disk_name(d);
+		for (unsigned i=0;(s = img_store_get(i));i++)
+			fprintf(f,"%c %s\n",strcmp(img_store_path(s),d)?' ':'*',img_store_path(s));
+		return;
+	}
+	if (strchr(b,'/')) snprintf(p,sizeof(p),"%s",b);
+	else snprintf(p,sizeof(p),"%s/%s",chg_lib,b);
+	if (disk_change(p,chg_sync)) {
+		fprintf(f,"%s: %s\n",b,strerror(errno));
+		return;
+	}
+	disk_name(d);
+	dbg(0,"Disk changed to \"%s\"\n",d);
+	fprintf(f,"OK %s\n",d);
+}
+
+static void* chg_main(void* arg) {
+	char b[PATH_MAX+1];
+	FILE* f;
+	int h;
+	while ((h = accept(chg_fd,NULL,NULL))>=0 || errno==EINTR || errno==ECONNABORTED) {
+		if (h<0) continue;
+		chg_line(h,b,sizeof(b));
+		if ((f = fdopen(h,"w"))) { chg_request(f,b); fclose(f); }
+		else close(h);
+	}
+	return arg;
+}
+
+// serve unix socket sock, to change to the images loaded from lib
+int changer_start(const char* sock, const char* lib, int sync) {
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	sigset_t all, old;
+
+	if (!sock || !*sock) return 0;
+	if (strlen(sock)>=sizeof(a.sun_path)) { dbg(0,"disk socket path too long: \"%s\"\n",sock); return -1; }
+	strcpy(a.sun_path,sock);
+	unlink(sock);
+	if ((chg_fd = socket(AF_UNIX,SOCK_STREAM,0))<0
+		|| bind(chg_fd,(struct sockaddr*)&a,sizeof(a))
+		|| listen(chg_fd,4)) {
+		dbg(0,"disk socket \"%s\": %s\n",sock,strerror(errno));
+		if (chg_fd>=0) close(chg_fd);
+		chg_fd = -1;
+		return -1;
+	}
+	fcntl(chg_fd,F_SETFD,FD_CLOEXEC);
+	strncpy(chg_sock,sock,PATH_MAX);
+	if (!realpath(lib,chg_lib)) strncpy(chg_lib,lib,PATH_MAX); // the way the store has the paths
+	chg_sync = sync;
+
+	// signals are for the other threads
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK,&all,&old);
+	if (pthread_create(&chg_thread,NULL,chg_main,NULL)) {
+		pthread_sigmask(SIG_SETMASK,&old,NULL);
+		dbg(0,"Can not start disk changer thread\n");
+		changer_stop();
+		return -1;
+	}
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+	dbg(1,"Disk socket: %s\n",sock);
+	atexit(changer_stop);
+	return 0;
+}
+
+// remove the socket
+void changer_stop(void) {
+	if (chg_sock[0]) unlink(chg_sock);
+	chg_sock[0] = 0x00;
+}
@@ -0,0 +1,9 @@
+// Disk changer, see changer.c
+
+#ifndef CHANGER_H
+#define CHANGER_H
+
+int  changer_start (const char* sock, const char* lib, int sync);
+void changer_stop (void);
+
+#endif
@@ -2,6 +2,7 @@
 #define PDD_CONSTANTS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // TPDD drive firmware/protocol constants
 
@@ -230,6 +231,7 @@ static const uint16_t FDC_LOGICAL_SECTOR_SIZE[7] = {64,80,128,256,512,1024,1280}
 // flags
 #define FE_FLAGS_NONE          0
 #define FE_FLAGS_DIR           1
+#define FE_FLAGS_IMG           2 // in the disk image, see img_fs.c
 #define NO_RET                 0
 #define ALLOW_RET              1
 #define CACHE_LOAD             0
@@ -263,4 +265,58 @@ static const uint16_t FDC_LOGICAL_SECTOR_SIZE[7] = {64,80,128,256,512,1024,1280}
 #define ATTR_DEF 0x46 // F - almost all clients on all platforms hardcode F
 #endif
 
+// client compatibility profiles
+//
+// KC-85
+// The platform can use lowercase filenames just fine, but at least both
+// TS-DOS and TEENY convert to uppercase in places, so upcase to avoid the battle.
+//
+// CP/M
+// https://www.shaels.net/index.php/cpm80-22-documents/using-cpm/3-file-names
+// "The CPM CPP module converts commands into upper case before they are executed
+//  which leads many to believe that the CPM file system is not case sensitive,
+//  when in fact the CPM file system is case sensitive. If you use a CPM program
+//  such as Microsoft Basic you can create file names which contain lower case
+//  characters. The problem is files which contain lower case characters can not
+//  be specified as parameters at the CPP command prompt, as the characters will
+//  be converted to upper case by the CPP before the command is executed."
+// So upcase to avoid the battle...
+//
+// REXCPM native is CP/M, but import & export are limited further to 6.2 upcase.
+//
+// Cambridge Z88 native is 12.3, not sure what DISCMNGR or DISC_RBL actually does.
+//
+// Atari ST native is CP/M, later MS-DOS, but PDDOS limits to 6.2
+//
+// MS-DOS (Atari Portfolio) by rights would be this:
+//	{ "msdos",  8,  3, false, ATTR_RAW, false, false, false },
+// except most of the pdd software was only made to work with Floppy/TS-DOS,
+// disks so even with an ms-dos client you usually want to use k85 or cpm
+//
+// Probably no xenix client exists until I port one, but it would be this:
+//	{ "xenix",  14, 0, false, ATTR_RAW, false, false, false }
+//
+//     id,   base, ext, pad,    attr,    dme,  magic, upcase
+#define CLIENT_PROFILES { \
+	{ "raw",    0,  0, false, ATTR_RAW, false, false, false }, \
+	{ "k85",    6,  2, true,  ATTR_DEF, true,  true,  true  }, \
+	{ "wp2",    8,  2, true,  ATTR_DEF, false, false, false }, \
+	{ "cpm",    8,  3, false, ATTR_DEF, false, false, true  }, \
+	{ "rexcpm", 6,  2, true,  ATTR_DEF, false, false, true  }, \
+	{ "z88",    12, 3, false, ATTR_DEF, false, false, false }, \
+	{ "st",     6,  2, true,  ATTR_DEF, false, false, true  }  \
+}
+
+#define PROFILE_ID_LEN 8
+typedef struct {
+	char    id[PROFILE_ID_LEN+1];
+	uint8_t base;
+	uint8_t ext;
+	bool    pad;
+	uint8_t attr;
+	bool    dme;
+	bool    magic;
+	bool    upcase;
+} CLIENT_PROFILE;
+
 #endif // PDD_CONSTANTS_H
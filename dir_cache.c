@@ -0,0 +1,300 @@
+// Directory snapshot cache
+//
+// update_file_list() used to re-read the whole directory, with a stat()
+// and a getxattr() per file, before every set-name and get-first.
+// Instead, keep a few snapshots of the finished FILE_ENTRY table,
+// keyed on the directory path and the things that change what goes in
+// the list (bank, TS-DOS directories, ".." entry).
+//
+// A snapshot stays valid until something changes in that directory.
+// On linux, inotify watches each snapshotted directory, and the inotify fd
+// raises SIGIO when an event is queued. The signal handler only sets a flag,
+// so as long as nothing changes, loading a snapshot costs no syscalls at all.
+// When the flag is set, the queued events are read and only the snapshots of
+// the affected directories are dropped.
+//
+// As a fallback, for platforms without inotify and for network filesystems
+// where inotify doesn't see changes made by other hosts, the directory's
+// mtime is re-checked every check_sec seconds. A file that is rewritten
+// in place, or gets a new attr xattr, doesn't change the directory's
+// mtime, so without inotify the size and ctime of every file in the
+// snapshot are re-checked as well. ctime changes with the contents and
+// the xattrs both, like IN_MODIFY and IN_ATTRIB do.
+//
+// The watch and the mtime are taken in dir_cache_load() when it misses,
+// before the caller reads the directory, so a change that happens while
+// the directory is being read discards the new snapshot instead of being lost.
+//
+// The slots are shared by all sessions, which may be on different threads,
+// so everything here is done under one mutex. The caller's own file list is
+// only touched while copying a snapshot in or out.
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define DC_INOTIFY_MASK (IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF)
+#endif
+
+#include "constants.h"
+#include "dir_list.h"
+#include "dir_cache.h"
+
+#if defined(__APPLE__)
+#define ST_MTIM(st) ((st).st_mtimespec)
+#define ST_CTIM(st) ((st).st_ctimespec)
+#else
+#define ST_MTIM(st) ((st).st_mtim)
+#define ST_CTIM(st) ((st).st_ctim)
+#endif
+
+// number of snapshots to keep
+#define DC_SLOTS 16
+
+typedef struct {
+	char        path[PATH_MAX+1];
+	uint8_t     key;
+	bool        valid;   // tbl[] is a complete, current listing
+	bool        pending; // watching, waiting for dir_cache_store()
+	int         wd;      // inotify watch descriptor
+	struct timespec mtime;
+	struct timespec ctime;
+	ino_t       ino;
+	time_t      checked; // last time mtime was compared
+	unsigned    used;    // lru
+	FILE_ENTRY* tbl;
+	struct timespec* fctime; // ctime of each file in tbl[], mtime only mode
+	int         n;
+} DIR_SNAPSHOT;
+
+static DIR_SNAPSHOT slots[DC_SLOTS];
+static unsigned used = 0;
+static int check_interval = 0;
+static bool enabled = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__linux__)
+static int ifd = -1;
+static atomic_int events = 0; // lock-free, so also safe in the handler
+
+static void sigio_handler (int sig) {
+	(void)sig;
+	atomic_store(&events,1);
+}
+#endif
+
+// no inotify, changes are only found by comparing mtimes
+static bool mtime_only (void) {
+#if defined(__linux__)
+	return ifd<0;
+#else
+	return true;
+#endif
+}
+
+static bool ts_eq (struct timespec a, struct timespec b) {
+	return a.tv_sec==b.tv_sec && a.tv_nsec==b.tv_nsec;
+}
+
+// the length a listing shows for a file, see dir_scan()
+static uint16_t st_len (const struct stat* st) {
+	return st->st_size>UINT16_MAX ? 0 : st->st_size;
+}
+
+// Check the size and ctime of every file in snapshot s against the files.
+// Fill in s->fctime[] first if set, else compare with it.
+// Returns false if any differs or is gone.
+static bool files_match (DIR_SNAPSHOT* s, bool set) {
+	struct stat st;
+	bool r = true;
+	int d, i;
+	if ((d = open(s->path,O_RDONLY|O_DIRECTORY|O_CLOEXEC))<0) return false;
+	for (i=0;r && i<s->n;i++) {
+		if (s->tbl[i].flags&FE_FLAGS_DIR) continue;
+		r = !fstatat(d,s->tbl[i].local_fname,&st,0) && st_len(&st)==s->tbl[i].len
+			&& (set || ts_eq(ST_CTIM(st),s->fctime[i]));
+		if (r && set) s->fctime[i] = ST_CTIM(st);
+	}
+	close(d);
+	return r;
+}
+
+static void drop (DIR_SNAPSHOT* s) {
+	s->valid = false;
+	s->pending = false;
+}
+
+// read the queued inotify events and drop the snapshots they affect
+static void poll_events (void) {
+#if defined(__linux__)
+	if (!atomic_exchange(&events,0)) return;
+
+	char b[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event* e;
+	ssize_t n;
+	int i;
+
+	while ((n = read(ifd,b,sizeof(b))) > 0) {
+		for (char* p = b; p < b+n; p += sizeof(struct inotify_event) + e->len) {
+			e = (const struct inotify_event*)p;
+			for (i=0;i<DC_SLOTS;i++) {
+				if (e->mask&IN_Q_OVERFLOW || slots[i].wd==e->wd) drop(&slots[i]);
+				if (e->mask&IN_IGNORED && slots[i].wd==e->wd) slots[i].wd = -1;
+			}
+		}
+	}
+#endif
+}
+
+static void unwatch (DIR_SNAPSHOT* s) {
+#if defined(__linux__)
+	if (s->wd<0) return;
+	for (int i=0;i<DC_SLOTS;i++) if (&slots[i]!=s && slots[i].wd==s->wd) { s->wd = -1; return; }
+	inotify_rm_watch(ifd,s->wd);
+#endif
+	s->wd = -1;
+}
+
+static DIR_SNAPSHOT* find (const char* path, uint8_t key) {
+	for (int i=0;i<DC_SLOTS;i++)
+		if (slots[i].key==key && slots[i].path[0] && !strcmp(slots[i].path,path)) return &slots[i];
+	return NULL;
+}
+
+int dir_cache_init (int check_sec) {
+	int i;
+	for (i=0;i<DC_SLOTS;i++) { memset(&slots[i],0,sizeof(DIR_SNAPSHOT)); slots[i].wd = -1; }
+	check_interval = check_sec;
+	enabled = true;
+
+#if defined(__linux__)
+	ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (ifd<0) return 0; // mtime only
+
+	struct sigaction sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = sigio_handler;
+	sa.sa_flags = SA_RESTART; // don't disturb the blocking tty read
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGIO,&sa,NULL);
+	fcntl(ifd,F_SETOWN,getpid());
+	fcntl(ifd,F_SETFL,fcntl(ifd,F_GETFL)|O_ASYNC);
+#endif
+	return 0;
+}
+
+void dir_cache_cleanup (void) {
+	pthread_mutex_lock(&lock);
+	for (int i=0;i<DC_SLOTS;i++) {
+		unwatch(&slots[i]);
+		free(slots[i].tbl);
+		free(slots[i].fctime);
+		slots[i].tbl = NULL;
+		slots[i].fctime = NULL;
+	}
+#if defined(__linux__)
+	if (ifd>=0) close(ifd);
+	ifd = -1;
+#endif
+	enabled = false;
+	pthread_mutex_unlock(&lock);
+}
+
+// Load the snapshot for path+key into l.
+// Returns 0 if loaded, 1 if the caller has to read the directory
+// and then call dir_cache_store().
+int dir_cache_load (FILE_LIST* l, const char* path, uint8_t key) {
+	if (!enabled) return 1;
+	pthread_mutex_lock(&lock);
+	poll_events();
+
+	struct stat st;
+	time_t now = time(NULL);
+	DIR_SNAPSHOT* s = find(path,key);
+
+	if (s && s->valid) {
+		if (now-s->checked >= check_interval) {
+			s->checked = now;
+			if (stat(path,&st) || !ts_eq(ST_MTIM(st),s->mtime) || !ts_eq(ST_CTIM(st),s->ctime)
+				|| st.st_ino!=s->ino || (mtime_only() && !files_match(s,false))) drop(s);
+		}
+		if (s->valid && !file_list_load(l,s->tbl,s->n)) {
+			s->used = ++used;
+			pthread_mutex_unlock(&lock);
+			return 0;
+		}
+	}
+
+	// miss - pick a slot, the least recently used if not already ours
+	if (!s) {
+		s = &slots[0];
+		for (int i=1;i<DC_SLOTS;i++) if (slots[i].used<s->used) s = &slots[i];
+		unwatch(s);
+		strncpy(s->path,path,PATH_MAX);
+		s->key = key;
+	}
+	drop(s);
+	s->used = ++used;
+
+	// start watching before the directory is read
+#if defined(__linux__)
+	if (ifd>=0 && s->wd<0) s->wd = inotify_add_watch(ifd,path,DC_INOTIFY_MASK);
+#endif
+	if (!stat(path,&st)) {
+		s->mtime = ST_MTIM(st);
+		s->ctime = ST_CTIM(st);
+		s->ino = st.st_ino;
+		s->checked = now;
+		s->pending = true;
+	}
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+// Save l as the snapshot for path+key,
+// unless the directory changed since dir_cache_load().
+void dir_cache_store (FILE_LIST* l, const char* path, uint8_t key) {
+	if (!enabled) return;
+	pthread_mutex_lock(&lock);
+	poll_events();
+
+	DIR_SNAPSHOT* s = find(path,key);
+	int n = file_list_len(l);
+	FILE_ENTRY* t;
+	struct timespec* m;
+	if (s && s->pending && (t = realloc(s->tbl,(n?n:1)*sizeof(FILE_ENTRY)))) {
+		memcpy(t,file_list_table(l),n*sizeof(FILE_ENTRY));
+		s->tbl = t;
+		s->n = n;
+		s->valid = true;
+		// a file that changed while the directory was being read
+		// has a different size now, and then this isn't kept
+		if (mtime_only()) {
+			if ((m = realloc(s->fctime,(n?n:1)*sizeof(struct timespec)))) s->fctime = m;
+			s->valid = m && files_match(s,true);
+		}
+	}
+	if (s) s->pending = false;
+	pthread_mutex_unlock(&lock);
+}
+
+// Something we did changed path. path==NULL means everything.
+// inotify would catch this anyway, but not on other platforms.
+void dir_cache_invalidate (const char* path) {
+	if (!enabled) return;
+	pthread_mutex_lock(&lock);
+	for (int i=0;i<DC_SLOTS;i++)
+		if (!path || !strcmp(slots[i].path,path)) drop(&slots[i]);
+	pthread_mutex_unlock(&lock);
+}
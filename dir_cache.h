@@ -0,0 +1,23 @@
+// Snapshots of translated directory listings, so that repeated
+// set-name and get-first requests on an unchanged directory don't
+// need to re-read the directory.
+
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <stdint.h>
+#include "dir_list.h"
+
+// snapshot key bits, along with the directory path
+#define DC_KEY_BANK1  0x01 // tpdd2 bank 1
+#define DC_KEY_DIRS   0x02 // directories included (TS-DOS dme)
+#define DC_KEY_PARENT 0x04 // ".." included
+
+int  dir_cache_init (int check_sec);
+void dir_cache_cleanup (void);
+
+int  dir_cache_load (FILE_LIST* l, const char* path, uint8_t key);
+void dir_cache_store (FILE_LIST* l, const char* path, uint8_t key);
+void dir_cache_invalidate (const char* path);
+
+#endif
@@ -24,90 +24,162 @@ MA 02111, USA.
 #include <string.h>
 #include <ctype.h>
 
+#include "fnv1a.h"
 #include "dir_list.h"
 
-static uint16_t allocated;
-static uint16_t ndx;
-static uint16_t cur;
-static FILE_ENTRY* tblp = 0;
+/*
+ * The table is kept in directory order for get_first/next/prev,
+ * with an open-addressing hash index next to it for find_file().
+ * hidx[] holds table positions +1, 0 = empty slot.
+ * index_size is a power of 2, at least 2x ndx.
+ *
+ * Every function works on the list it's given. Each client session has
+ * its own, so sessions can be served from different threads.
+ */
+
+#define INDEX_MIN 128 /* power of 2, more than 2x DIRENTS */
+
+static FILE_ENTRY* current_record(FILE_LIST* l);
+
+/* FNV-1a over the name and the attr */
+static uint32_t hash(const char* client_fname, uint8_t attr) {
+	return fnv1a_add(fnv1a(client_fname,strlen(client_fname)),&attr,1);
+}
+
+/* slot holding the first record matching name+attr, or the empty slot where it would go */
+static uint32_t* index_slot(FILE_LIST* l, const char* client_fname, uint8_t attr) {
+	unsigned m = l->index_size-1;
+	unsigned i = hash(client_fname,attr) & m;
+	FILE_ENTRY* e;
+	while (l->hidx[i]) {
+		e = l->tbl + l->hidx[i] - 1;
+		if (e->attr==attr && !strcmp(client_fname,e->client_fname)) break;
+		i = (i+1) & m;
+	}
+	return l->hidx+i;
+}
 
-static FILE_ENTRY* current_record(void);
+/* add record n to the index, unless an earlier record has the same name+attr */
+static void index_add(FILE_LIST* l, unsigned n) {
+	uint32_t* p = index_slot(l,l->tbl[n].client_fname,l->tbl[n].attr);
+	if (!*p) *p = n+1;
+}
 
-int file_list_init() {
-	tblp = malloc(sizeof(FILE_ENTRY)*DIRENTS);
-	if (!tblp) return -1;
-	allocated = DIRENTS;
-	ndx = 0;
-	cur = 0;
+static int index_resize(FILE_LIST* l, unsigned size) {
+	uint32_t* p = calloc(size,sizeof(uint32_t));
+	if (!p) return -1;
+	free(l->hidx);
+	l->hidx = p;
+	l->index_size = size;
+	for (unsigned i=0;i<l->ndx;i++) index_add(l,i);
 	return 0;
 }
 
-int file_list_cleanup() {
-	allocated = 0;
-	ndx = 0;
-	cur = 0;
-	if (tblp) free(tblp);
-	tblp = NULL;
+static int table_resize(FILE_LIST* l, unsigned size) {
+	FILE_ENTRY* p = realloc(l->tbl, size*sizeof(FILE_ENTRY));
+	if (!p) return -1;
+	l->tbl = p;
+	l->allocated = size;
 	return 0;
 }
 
-void file_list_clear_all() {
-	cur = ndx = 0;
+int file_list_init(FILE_LIST* l) {
+	l->tbl = malloc(sizeof(FILE_ENTRY)*DIRENTS);
+	if (!l->tbl) return -1;
+	l->allocated = DIRENTS;
+	l->ndx = 0;
+	l->cur = 0;
+	l->index_size = 0;
+	return index_resize(l,INDEX_MIN);
 }
 
-int add_file(FILE_ENTRY* fe) {
-	/* allocate DIRENTS more records if out of space */
-	if (ndx >= allocated) {
-		/* resize the array */
-		tblp = realloc(tblp, (allocated+DIRENTS)*sizeof(FILE_ENTRY));
-		if (!tblp) return -1;
-		allocated += DIRENTS;
-	}
+int file_list_cleanup(FILE_LIST* l) {
+	l->allocated = 0;
+	l->ndx = 0;
+	l->cur = 0;
+	if (l->tbl) free(l->tbl);
+	l->tbl = NULL;
+	free(l->hidx);
+	l->hidx = NULL;
+	l->index_size = 0;
+	return 0;
+}
+
+void file_list_clear_all(FILE_LIST* l) {
+	l->cur = l->ndx = 0;
+	if (l->hidx) memset(l->hidx, 0, l->index_size*sizeof(uint32_t));
+}
+
+int add_file(FILE_LIST* l, FILE_ENTRY* fe) {
+	/* double the space if out of space */
+	if (l->ndx >= l->allocated && table_resize(l,l->allocated*2)) return -1;
+	if (l->ndx*2 >= l->index_size && index_resize(l,l->index_size*2)) return -1;
 
 	/* reference the entry */
-	if (!tblp) return -1;
+	if (!l->tbl) return -1;
 
-	memcpy(tblp+ndx, fe, sizeof(FILE_ENTRY));
+	memcpy(l->tbl+l->ndx, fe, sizeof(FILE_ENTRY));
+	index_add(l,l->ndx);
 	/* adjust cur to address this record, ndx to next avail */
-	cur = ndx;
-	ndx++;
+	l->cur = l->ndx;
+	l->ndx++;
 
 	return 0;
 }
 
-FILE_ENTRY* find_file(char* client_fname, uint8_t attr) {
-	int i;
-	for (i=0;i<ndx;i++) {
-		if (
-				!strcmp(client_fname,tblp[i].client_fname)
-				&&
-				tblp[i].attr==attr
-			) return &tblp[i];
-	}
+int file_list_len(FILE_LIST* l) {
+	return l->ndx;
+}
+
+FILE_ENTRY* file_list_table(FILE_LIST* l) {
+	return l->tbl;
+}
+
+/* replace the whole list with n records from t[] */
+int file_list_load(FILE_LIST* l, FILE_ENTRY* t, int n) {
+	unsigned s;
+	if (n > l->allocated && table_resize(l,n)) return -1;
+	if (!l->tbl) return -1;
+
+	memcpy(l->tbl, t, n*sizeof(FILE_ENTRY));
+	/* same state add_file() would have left */
+	l->ndx = n;
+	l->cur = n ? n-1 : 0;
+
+	for (s=l->index_size; s<=l->ndx*2; s*=2);
+	if (s!=l->index_size) return index_resize(l,s);
+	memset(l->hidx, 0, l->index_size*sizeof(uint32_t));
+	for (s=0;s<l->ndx;s++) index_add(l,s);
 	return 0;
 }
 
-FILE_ENTRY* get_first_file(void) {
-	cur = 0;
-	return current_record();
+FILE_ENTRY* find_file(FILE_LIST* l, char* client_fname, uint8_t attr) {
+	if (!l->hidx) return 0;
+	uint32_t* p = index_slot(l,client_fname,attr);
+	return *p ? l->tbl + *p - 1 : 0;
+}
+
+FILE_ENTRY* get_first_file(FILE_LIST* l) {
+	l->cur = 0;
+	return current_record(l);
 }
 
-FILE_ENTRY* get_next_file(void) {
-	if (cur + 1 > ndx) return NULL;
-	cur++;
-	return current_record();
+FILE_ENTRY* get_next_file(FILE_LIST* l) {
+	if (l->cur + 1 > l->ndx) return NULL;
+	l->cur++;
+	return current_record(l);
 }
    
-FILE_ENTRY* get_prev_file(void) {
-	if (cur==0) return NULL;
-	cur--;
-	return current_record();
+FILE_ENTRY* get_prev_file(FILE_LIST* l) {
+	if (l->cur==0) return NULL;
+	l->cur--;
+	return current_record(l);
 }
 
-static FILE_ENTRY* current_record(void) {
+static FILE_ENTRY* current_record(FILE_LIST* l) {
 	FILE_ENTRY* ep;
-	if (cur >= ndx) return NULL;
-	if (!tblp) return NULL;
-	ep = tblp + cur;
+	if (l->cur >= l->ndx) return NULL;
+	if (!l->tbl) return NULL;
+	ep = l->tbl + l->cur;
 	return ep;
 }
@@ -32,15 +32,30 @@ typedef struct {
 	uint8_t  flags;
 } FILE_ENTRY;
 
-int file_list_init ();
-int file_list_cleanup ();
-
-void file_list_clear_all ();
-int  add_file (FILE_ENTRY* fe);
-
-FILE_ENTRY* find_file (char* client_fname, uint8_t attr);
-FILE_ENTRY* get_first_file (void);
-FILE_ENTRY* get_next_file (void);
-FILE_ENTRY* get_prev_file (void);
+// One directory listing, ordered for get_first/next/prev,
+// plus the hash index for find_file(). See dir_list.c
+typedef struct {
+	FILE_ENTRY* tbl;
+	uint32_t*   hidx;
+	unsigned    allocated;
+	unsigned    ndx;
+	unsigned    cur;
+	unsigned    index_size;
+} FILE_LIST;
+
+int file_list_init (FILE_LIST* l);
+int file_list_cleanup (FILE_LIST* l);
+
+void file_list_clear_all (FILE_LIST* l);
+int  add_file (FILE_LIST* l, FILE_ENTRY* fe);
+
+int  file_list_len (FILE_LIST* l);
+FILE_ENTRY* file_list_table (FILE_LIST* l);
+int  file_list_load (FILE_LIST* l, FILE_ENTRY* t, int n);
+
+FILE_ENTRY* find_file (FILE_LIST* l, char* client_fname, uint8_t attr);
+FILE_ENTRY* get_first_file (FILE_LIST* l);
+FILE_ENTRY* get_next_file (FILE_LIST* l);
+FILE_ENTRY* get_prev_file (FILE_LIST* l);
 
 #endif
@@ -0,0 +1,480 @@
+// Disk image access
+//
+// The image file used to be opened, seeked, read or written, and closed
+// again for every FDC and TPDD2 sector command. Now it's opened once when
+// the image is selected and mapped for its whole fixed size, PDD1_IMG_LEN
+// or PDD2_IMG_LEN, so every sector command is just a memcpy to or from the
+// mapping. A file of any other size is refused.
+//
+// If another program truncates the file while it's mapped, touching the
+// part that's gone raises SIGBUS. The handler maps zero pages over it so
+// dl carries on. The command that hit it sees zeros, and the next
+// disk_img_check() maps the file again as it is now, which fails until the
+// file is whole again, so the client gets errors instead of dl dying.
+//
+// The image is mapped shared, so writes land in the page cache right away,
+// same as a write() did before. disk_img_commit() is called after each
+// write command, and only decides when the kernel is asked to write the
+// dirty pages back to the file.
+//
+// An image that doesn't exist yet is only remembered by name, and is
+// created and mapped by disk_img_create() when the client formats it.
+//
+// All access goes through disk_img_rec() for reading, disk_img_rec_w()
+// for writing, and disk_img_commit() after writing.
+//
+// The sector IDs are indexed, so that FDC search-id doesn't have to scan
+// the image. The index is built when the image is mapped, and each
+// record is re-indexed in disk_img_commit(), so anything that writes a
+// record must commit it, even with DISK_SYNC_NONE. Changes made to the
+// image file by other programs while it's mapped are not seen by the index.
+//
+// An image that was loaded into img_store.c with -L isn't mapped. Its
+// records come from the store, which handles writing to them, and
+// disk_img_commit() has the store write them to the file.
+//
+// A virtual image, from disk_img_virtual(), has no file behind it. It's an
+// anonymous mapping that starts out as untouched zero pages, and each record
+// is filled in by the fill() callback the first time anything looks at it,
+// so a record the client never reads is never built. Search-id needs every
+// ID, so the index of a virtual image is only built on the first search,
+// and only asks fill() for the headers. Virtual images are write-protected.
+//
+// With an overlay (DISK_OVL), the image is only the read-only base, and
+// every record written goes to the overlay instead: the first
+// disk_img_rec_w() of a record copies it from the base, and
+// disk_img_commit() writes it to the overlay's delta file, a short header
+// and then a record number + record for each record in the overlay. Each
+// session may have its own overlay, and gives it to disk_img_lock(), so
+// everything up to disk_img_unlock() sees the base through that overlay.
+// Many sessions can so share one base image, and deleting a delta file
+// puts that session back to the pristine image.
+//
+// disk_img_gen() changes whenever the image is remapped, a record is
+// committed, or a different overlay is looked through, so that img_fs.c knows when to parse the filesystem again.
+//
+// There is one image for all sessions. A session that may be on its own
+// thread holds disk_img_lock() from looking up a record until it's done
+// with it, and doesn't keep the record pointer past disk_img_unlock(),
+// since another session's format may remap the image.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "constants.h"
+#include "fnv1a.h"
+#include "disk_img.h"
+#include "img_store.h"
+
+static char path[PATH_MAX+1];
+static int fd = -1;
+static uint8_t* img = NULL;
+static STORE_IMG* simg = NULL; // in img_store.c instead of img
+static size_t len = 0;
+static bool wp = false;
+static int sync_policy = DISK_SYNC_ASYNC;
+static unsigned gen = 0;
+static DISK_IMG_FILL fill = NULL; // virtual image
+static uint8_t* filled = NULL;    // per record, 0 = nothing, 1 = header, 2 = all
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int lost = 0;       // SIGBUS in the mapping, the file shrank
+static long page_len = 0;
+static size_t want = 0;           // the size disk_img_open() was asked for
+
+struct DISK_OVL {
+	int fd;
+	int nrec;
+	uint8_t** rec;  // records in the overlay, NULL = the base record
+	int16_t* slot;  // where each one is in the delta file, -1 = not yet
+	int nslot;
+};
+static DISK_OVL* ovl = NULL;  // the one disk_img_lock() was given
+static DISK_OVL* ovl_last = NULL;
+
+// ID index: hash buckets of records, each chain in record order
+#define ID_BUCKETS 64
+static int16_t id_head[ID_BUCKETS];
+static int16_t* id_next = NULL; // next record in the same bucket, -1 = end
+static uint8_t* id_bucket = NULL; // which bucket each record is in
+static int nrec = 0;
+
+// record rn as it is, no bounds check
+static uint8_t* raw_rec (int rn) {
+	return simg ? img_store_rec(simg,rn) : img+rn*SECTOR_LEN;
+}
+
+// Search compares IDs with strncmp(), so hash only up to the first NUL,
+// so that all IDs that strncmp() considers equal land in the same bucket.
+static uint8_t id_hash (const uint8_t* id) {
+	uint32_t h = fnv1a(id,strnlen((const char*)id,SECTOR_ID_LEN));
+	return (h ^ h>>16) % ID_BUCKETS;
+}
+
+static void id_unlink (int rn) {
+	int16_t* p = &id_head[id_bucket[rn]];
+	while (*p>=0 && *p!=rn) p = &id_next[*p];
+	if (*p==rn) *p = id_next[rn];
+	id_next[rn] = -1;
+}
+
+static void id_link (int rn) {
+	uint8_t b = id_hash(raw_rec(rn)+1);
+	int16_t* p = &id_head[b];
+	while (*p>=0 && *p<rn) p = &id_next[*p];
+	id_next[rn] = *p;
+	*p = rn;
+	id_bucket[rn] = b;
+}
+
+static void id_index_free (void) {
+	free(id_next);
+	free(id_bucket);
+	id_next = NULL;
+	id_bucket = NULL;
+	nrec = 0;
+}
+
+// a virtual record, built up to the header (data=false) or the whole thing
+static void fill_rec (int rn, bool data) {
+	if (filled[rn]>=(data?2:1)) return;
+	fill(rn,img+rn*SECTOR_LEN,data);
+	filled[rn] = data ? 2 : 1;
+}
+
+static int id_index_build (void) {
+	int rn;
+	id_index_free();
+	nrec = len/SECTOR_LEN;
+	if (fill) for (rn=0;rn<nrec;rn++) fill_rec(rn,false);
+	id_next = malloc(nrec*sizeof(int16_t));
+	id_bucket = malloc(nrec);
+	if (!id_next || !id_bucket) { id_index_free(); return -1; }
+	for (rn=0;rn<ID_BUCKETS;rn++) id_head[rn] = -1;
+	for (rn=nrec-1;rn>=0;rn--) { id_next[rn] = -1; id_link(rn); }
+	return 0;
+}
+
+static void unmap (void) {
+	gen++;
+	id_index_free();
+	if (img) munmap(img,len);
+	if (fd>=0) close(fd);
+	free(filled);
+	filled = NULL;
+	fill = NULL;
+	img = NULL;
+	simg = NULL; // stays in the store
+	len = 0;
+	fd = -1;
+}
+
+// A fault in the mapping is from the thread holding the lock,
+// so img and len are the ones it's using.
+static void sigbus_handler (int sig, siginfo_t* si, void* uc) {
+	uint8_t* a = si->si_addr;
+	(void)uc;
+	if (img && a>=img && a<img+len) {
+		a = img+(a-img)/page_len*page_len;
+		if (mmap(a,page_len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,-1,0)!=MAP_FAILED) {
+			atomic_store(&lost,1);
+			return;
+		}
+	}
+	signal(sig,SIG_DFL); // not ours, fault again and die the usual way
+}
+
+static int map (void) {
+	if (!page_len) {
+		struct sigaction sa;
+		memset(&sa,0,sizeof(sa));
+		sa.sa_sigaction = sigbus_handler;
+		sa.sa_flags = SA_SIGINFO;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGBUS,&sa,NULL);
+		page_len = sysconf(_SC_PAGESIZE);
+	}
+	atomic_store(&lost,0);
+	gen++;
+	img = mmap(NULL,len,wp?PROT_READ:PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if (img==MAP_FAILED) { img = NULL; return -1; }
+	return id_index_build();
+}
+
+// lock the image, and look at it through overlay o, NULL for none
+void disk_img_lock (DISK_OVL* o) {
+	pthread_mutex_lock(&lock);
+	ovl = o;
+	if (o!=ovl_last) gen++;
+	ovl_last = o;
+}
+
+void disk_img_unlock (void) {
+	pthread_mutex_unlock(&lock);
+}
+
+// Select an image file of l bytes. If it exists and isn't empty, open and
+// map it. Returns -1 with errno set if an existing image can't be mapped,
+// EINVAL if it isn't l bytes.
+int disk_img_open (const char* fname, size_t l, int sync) {
+	struct stat st;
+
+	unmap();
+	strncpy(path,fname,PATH_MAX);
+	sync_policy = sync;
+	wp = false;
+	want = l;
+
+	if (stat(path,&st) || st.st_size<1) return 0; // created by format
+	if ((size_t)st.st_size!=l) { errno = EINVAL; return -1; }
+
+	if ((simg = img_store_find(path)) && img_store_len(simg)==l)
+		return disk_img_open_store(simg,sync);
+	simg = NULL;
+
+	if ((fd = open(path,O_RDWR)) < 0) {
+		if (errno!=EACCES && errno!=EROFS && errno!=EPERM) return -1;
+		wp = true;
+		if ((fd = open(path,O_RDONLY)) < 0) return -1;
+	}
+	len = l;
+	if (map()) { unmap(); return -1; }
+	return 0;
+}
+
+// With the lock held, before using the image. If the file shrank under the
+// mapping, map it again as it is now. -1 with errno set if that fails,
+// and then there's no image until it's selected again.
+int disk_img_check (void) {
+	char p[PATH_MAX+1];
+	if (!atomic_load(&lost)) return 0;
+	strcpy(p,path);
+	return disk_img_open(p,want,sync_policy);
+}
+
+// Select image s from the store, whether or not its file is still there.
+int disk_img_open_store (STORE_IMG* s, int sync) {
+	unmap();
+	strncpy(path,img_store_path(s),PATH_MAX);
+	sync_policy = sync;
+	simg = s;
+	len = img_store_len(s);
+	wp = img_store_wp(s);
+	gen++;
+	if (id_index_build()) { unmap(); path[0] = 0; return -1; }
+	return 0;
+}
+
+void disk_img_close (void) {
+	if (img && !wp) msync(img,len,MS_SYNC);
+	unmap();
+	path[0] = 0;
+}
+
+// Select a virtual image of l bytes, built by f as it's read.
+int disk_img_virtual (size_t l, DISK_IMG_FILL f) {
+	unmap();
+	path[0] = 0;
+	wp = true;
+	len = l;
+	img = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if (img==MAP_FAILED || !(filled = calloc(len/SECTOR_LEN,1))) {
+		if (img==MAP_FAILED) img = NULL;
+		unmap();
+		return -1;
+	}
+	fill = f;
+	gen++;
+	return 0;
+}
+
+// Create the image file, or grow it, so that it holds at least l bytes,
+// and map it. Used by format. Never shrinks an existing image.
+int disk_img_create (size_t l) {
+	if (!path[0]) return -1;
+	if ((img || simg) && len>=l) return 0;
+	if (wp || ovl) { errno = EACCES; return -1; } // never write the base of an overlay
+
+	if (img) munmap(img,len);
+	img = NULL;
+	simg = NULL; // grown past the stored copy, the file has the rest
+	id_index_free();
+	if (fd<0 && (fd = open(path,O_RDWR|O_CREAT,0666)) < 0) return -1;
+
+	struct stat st;
+	if (fstat(fd,&st)) return -1;
+	if ((size_t)st.st_size<l && ftruncate(fd,l)) return -1;
+	len = (size_t)st.st_size<l ? l : (size_t)st.st_size;
+	if (map()) { unmap(); return -1; }
+	return 0;
+}
+
+// size of the mapped image, 0 if none
+size_t disk_img_len (void) {
+	return len;
+}
+
+// changes with every remap and commit
+unsigned disk_img_gen (void) {
+	return gen;
+}
+
+// the image exists but can't be written
+bool disk_img_wp (void) {
+	return ovl ? false : wp;
+}
+
+// the image is from disk_img_virtual()
+bool disk_img_is_virtual (void) {
+	return fill!=NULL;
+}
+
+static uint8_t* base_rec (int rn) {
+	if ((!img && !simg) || rn<0 || (size_t)(rn+1)*SECTOR_LEN>len) return NULL;
+	if (fill) fill_rec(rn,true);
+	return raw_rec(rn);
+}
+
+// record rn (LSC/ID/unknown + DATA), NULL if not in the image
+uint8_t* disk_img_rec (int rn) {
+	if (ovl && rn>=0 && rn<ovl->nrec && ovl->rec[rn]) return ovl->rec[rn];
+	return base_rec(rn);
+}
+
+// record rn for writing, NULL if not in the image or write-protected
+uint8_t* disk_img_rec_w (int rn) {
+	uint8_t* b;
+	if (ovl) {
+		if (rn<0 || rn>=ovl->nrec || !(b = base_rec(rn))) return NULL;
+		if (!ovl->rec[rn] && (ovl->rec[rn] = malloc(SECTOR_LEN))) memcpy(ovl->rec[rn],b,SECTOR_LEN);
+		return ovl->rec[rn];
+	}
+	if (wp) return NULL;
+	if (simg) return base_rec(rn) ? img_store_rec_w(simg,rn) : NULL;
+	return base_rec(rn);
+}
+
+// first record in 0 to rc-1 whose ID matches id the way strncmp() does,
+// -1 if none
+int disk_img_find_id (const uint8_t* id, int rc) {
+	int r = -1, rn;
+	if (fill && !id_next && id_index_build()) return -1;
+	if (!id_next) return -1;
+	// the base records that aren't overlaid, then any overlaid one before that
+	for (rn=id_head[id_hash(id)]; rn>=0 && rn<rc; rn=id_next[rn]) {
+		if (ovl && rn<ovl->nrec && ovl->rec[rn]) continue;
+		if (!strncmp((const char*)id,(const char*)raw_rec(rn)+1,SECTOR_ID_LEN)) { r = rn; break; }
+	}
+	if (ovl) for (rn=0;rn<ovl->nrec && rn<rc && (r<0 || rn<r);rn++)
+		if (ovl->rec[rn] && !strncmp((const char*)id,(const char*)ovl->rec[rn]+1,SECTOR_ID_LEN)) return rn;
+	return r;
+}
+
+#define OVL_MAGIC "DLOVL"
+#define OVL_HEADER_LEN 8 // magic, version, 2 unused
+#define OVL_VERSION 1
+#define OVL_ENTRY_LEN (2+SECTOR_LEN) // record number LSB first, record
+
+// Open or create the delta file f for the image as it is now, and load
+// the records already in it. NULL if there's no image yet, or f can't be
+// opened.
+DISK_OVL* disk_img_ovl_open (const char* f) {
+	uint8_t h[OVL_HEADER_LEN] = OVL_MAGIC;
+	uint8_t e[OVL_ENTRY_LEN];
+	DISK_OVL* o;
+	int rn;
+
+	pthread_mutex_lock(&lock);
+	if (!len || !(o = calloc(1,sizeof(DISK_OVL)))) { pthread_mutex_unlock(&lock); return NULL; }
+	o->nrec = len/SECTOR_LEN;
+	o->rec = calloc(o->nrec,sizeof(uint8_t*));
+	o->slot = malloc(o->nrec*sizeof(int16_t));
+	if (!o->rec || !o->slot || (o->fd = open(f,O_RDWR|O_CREAT|O_CLOEXEC,0666))<0) {
+		o->fd = -1;
+		pthread_mutex_unlock(&lock);
+		disk_img_ovl_close(o);
+		return NULL;
+	}
+	for (rn=0;rn<o->nrec;rn++) o->slot[rn] = -1;
+
+	h[5] = OVL_VERSION;
+	rn = pread(o->fd,e,OVL_HEADER_LEN,0);
+	if (!rn ? pwrite(o->fd,h,OVL_HEADER_LEN,0)!=OVL_HEADER_LEN : rn!=OVL_HEADER_LEN || memcmp(e,h,6)) {
+		if (rn) errno = EINVAL; // not a delta file, leave it alone
+		pthread_mutex_unlock(&lock);
+		disk_img_ovl_close(o);
+		return NULL;
+	}
+	while (pread(o->fd,e,OVL_ENTRY_LEN,OVL_HEADER_LEN+(off_t)o->nslot*OVL_ENTRY_LEN)==OVL_ENTRY_LEN) {
+		rn = e[0] | e[1]<<8;
+		if (rn<o->nrec && (o->rec[rn] || (o->rec[rn] = malloc(SECTOR_LEN)))) {
+			memcpy(o->rec[rn],e+2,SECTOR_LEN);
+			o->slot[rn] = o->nslot;
+		}
+		o->nslot++;
+	}
+	pthread_mutex_unlock(&lock);
+	return o;
+}
+
+void disk_img_ovl_close (DISK_OVL* o) {
+	if (!o) return;
+	pthread_mutex_lock(&lock);
+	if (ovl_last==o) ovl_last = NULL;
+	gen++;
+	pthread_mutex_unlock(&lock);
+	if (o->rec) for (int rn=0;rn<o->nrec;rn++) free(o->rec[rn]);
+	if (o->fd>=0) close(o->fd);
+	free(o->rec);
+	free(o->slot);
+	free(o);
+}
+
+// write record rn of the overlay, or all of them for rn<0, to the delta file
+static void ovl_commit (int rn) {
+	uint8_t n[2];
+	struct iovec v[2] = {{n,2},{NULL,SECTOR_LEN}};
+	int i = rn<0 ? 0 : rn, e = rn<0 ? ovl->nrec : rn+1;
+	for (;i<e && i<ovl->nrec;i++) {
+		if (!ovl->rec[i]) continue;
+		if (ovl->slot[i]<0) ovl->slot[i] = ovl->nslot++;
+		n[0] = i; n[1] = i>>8;
+		v[1].iov_base = ovl->rec[i];
+		if (pwritev(ovl->fd,v,2,OVL_HEADER_LEN+(off_t)ovl->slot[i]*OVL_ENTRY_LEN)!=OVL_ENTRY_LEN) return;
+	}
+	if (sync_policy==DISK_SYNC_SYNC) fdatasync(ovl->fd);
+}
+
+// record rn was written, re-index it and flush it according to the sync policy
+// rn<0 = the whole image
+void disk_img_commit (int rn) {
+	if (ovl) { gen++; ovl_commit(rn); return; }
+	if ((!img && !simg) || wp) return;
+	gen++;
+	if (simg) img_store_commit(simg,rn,sync_policy==DISK_SYNC_SYNC); // before re-indexing, it may move
+	if (rn<0) id_index_build();
+	else if (rn<nrec) { id_unlink(rn); id_link(rn); }
+	if (simg) return;
+
+	if (sync_policy==DISK_SYNC_NONE) return;
+	if (rn<0) { msync(img,len,sync_policy==DISK_SYNC_SYNC?MS_SYNC:MS_ASYNC); return; }
+	uint8_t* r = disk_img_rec(rn);
+	if (!r) return;
+
+	// msync wants a page aligned start
+	size_t pg = sysconf(_SC_PAGESIZE);
+	size_t o = (r-img) & ~(pg-1);
+	size_t l = (r-img) + SECTOR_LEN - o;
+	msync(img+o,l,sync_policy==DISK_SYNC_SYNC?MS_SYNC:MS_ASYNC);
+}
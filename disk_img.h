@@ -0,0 +1,49 @@
+// Disk image access for the FDC and TPDD2 sector commands.
+// The image is opened once and mapped, and the sector commands
+// work directly on the records in memory.
+
+#ifndef DISK_IMG_H
+#define DISK_IMG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "img_store.h"
+
+// when to flush written records to the image file
+#define DISK_SYNC_NONE  0 // leave it to the kernel
+#define DISK_SYNC_ASYNC 1 // schedule writeback after every write command
+#define DISK_SYNC_SYNC  2 // finish writeback before responding to a write command
+
+// a session's own changes to the image, see disk_img.c
+typedef struct DISK_OVL DISK_OVL;
+
+// builds record rn of a virtual image in rec, just the header unless data
+typedef void (*DISK_IMG_FILL)(int rn, uint8_t* rec, bool data);
+
+void disk_img_lock (DISK_OVL* o);
+void disk_img_unlock (void);
+
+int  disk_img_open (const char* fname, size_t len, int sync);
+int  disk_img_open_store (STORE_IMG* s, int sync);
+int  disk_img_check (void);
+void disk_img_close (void);
+int  disk_img_create (size_t len);
+int  disk_img_virtual (size_t len, DISK_IMG_FILL fill);
+
+size_t disk_img_len (void);
+bool disk_img_wp (void);
+bool disk_img_is_virtual (void);
+unsigned disk_img_gen (void);
+
+uint8_t* disk_img_rec (int rn);
+uint8_t* disk_img_rec_w (int rn);
+void disk_img_commit (int rn);
+
+int  disk_img_find_id (const uint8_t* id, int rc);
+
+DISK_OVL* disk_img_ovl_open (const char* f);
+void disk_img_ovl_close (DISK_OVL* o);
+
+#endif
@@ -0,0 +1,24 @@
+// FNV-1a hash, for the hash tables in dir_list.c, disk_img.c, img_fs.c,
+// img_store.c, and the filename cache in tpdd.c
+
+#ifndef FNV1A_H
+#define FNV1A_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FNV1A_BASIS 2166136261u
+#define FNV1A_PRIME 16777619u
+
+// continue hash h over n more bytes
+static inline uint32_t fnv1a_add (uint32_t h, const void* d, size_t n) {
+	const uint8_t* b = d;
+	while (n--) { h ^= *b++; h *= FNV1A_PRIME; }
+	return h;
+}
+
+static inline uint32_t fnv1a (const void* d, size_t n) {
+	return fnv1a_add(FNV1A_BASIS,d,n);
+}
+
+#endif
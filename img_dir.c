@@ -0,0 +1,170 @@
+// Virtual disk image of a directory
+//
+// -i with a directory instead of an image file presents the files in that
+// directory as a freshly written TPDD disk, for clients that only use
+// sector access, like BACKUP.BA and FDC-mode tools.
+//
+// Nothing is read when the directory is selected. The first time a client
+// looks at any sector, the directory is read once to lay out the disk:
+// each regular file gets an FCB in sector 0 and a contiguous run of
+// sectors, in directory order, until the FCB table or the disk is full.
+// Files that don't fit are left off. The FCB table, the SMT, and the ID
+// bytes that link the sectors of each file are made the same way img_fs.c
+// writes them, so the result reads like any other disk.
+//
+// After that, each sector is only built when it's read, see
+// disk_img_virtual(), and the data of a file sector is read from the file
+// right then. The layout stays the same until the directory is selected
+// again, so a file that changes size afterwards is cut off or padded with
+// zeros to the size it had.
+//
+// The image is write-protected, and the Operation-mode file commands keep
+// using the share path, not the image.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "tpdd.h"
+#include "disk_img.h"
+#include "img_fs.h"
+#include "img_dir.h"
+#include "xattr.h"
+
+#define DIR_RECS (PDD2_TRACKS*PDD2_SECTORS)
+
+typedef struct {
+	char local_fname[LOCAL_FILENAME_MAX+1];
+	uint8_t fcb[IMG_FCB_LEN];
+	uint16_t len;
+	uint8_t head;
+} DIR_FILE;
+
+static char dir_path[PATH_MAX+1];
+static int dir_fd = -1;
+static DIR_FILE files[DIRENTS];
+static int nfiles = 0;
+static int16_t sec_file[DIR_RECS]; // file in each sector, -1 = free
+static int nrec = 0;               // sectors, 0 = not laid out yet
+static int nused = 0;              // sectors used by files
+
+static int banks (void) {
+	return model==2 ? 2 : 1;
+}
+
+// give f the next free sectors, unless it doesn't fit or the name is taken
+static bool place (DIR_FILE* f, int* rn) {
+	int k = (f->len+SECTOR_DATA_LEN-1)/SECTOR_DATA_LEN;
+	for (int i=0;i<nfiles;i++)
+		if (files[i].fcb[24]==f->fcb[24] && !memcmp(files[i].fcb,f->fcb,TPDD_FILENAME_LEN)) return false;
+	if (*rn+k>nrec) return false;
+	f->head = k ? *rn : 0;
+	f->fcb[25] = f->len>>8;
+	f->fcb[26] = f->len&0xFF;
+	f->fcb[29] = f->head;
+	f->fcb[30] = k ? *rn+k-1 : 0;
+	for (;k>0;k--) sec_file[(*rn)++] = nfiles;
+	return true;
+}
+
+// read the directory and decide where everything goes
+static void layout (void) {
+	struct stat st;
+	struct dirent* d;
+	FILE_ENTRY e;
+	DIR* dir;
+	int fd, rn;
+#ifdef USE_XATTR
+	char p[PATH_MAX+LOCAL_FILENAME_MAX+2];
+#endif
+
+	nrec = model==2 ? PDD2_TRACKS*PDD2_SECTORS : PDD1_TRACKS*PDD1_SECTORS;
+	nfiles = 0;
+	for (rn=0;rn<DIR_RECS;rn++) sec_file[rn] = -1;
+	rn = banks();
+
+	if ((fd = dup(dir_fd))<0 || !(dir = fdopendir(fd))) {
+		dbg(0,"%s: %s\n",dir_path,strerror(errno));
+		if (fd>=0) close(fd);
+		nused = 0;
+		return;
+	}
+	rewinddir(dir);
+	while (nfiles<DIRENTS && rn<nrec && (d = readdir(dir))) {
+		if (d->d_name[0]=='.' || strlen(d->d_name)>LOCAL_FILENAME_MAX) continue;
+		if (fstatat(dir_fd,d->d_name,&st,0) || !S_ISREG(st.st_mode) || st.st_size>IMG_FILE_MAX) continue;
+		uint8_t attr = default_attr;
+#ifdef USE_XATTR
+		snprintf(p,sizeof(p),"%s/%s",dir_path,d->d_name);
+		dl_getxattr(p,&attr);
+#endif
+		make_file_entry(&e,d->d_name,attr,st.st_size,FE_FLAGS_NONE);
+		DIR_FILE* f = &files[nfiles];
+		memset(f,0x00,sizeof(DIR_FILE));
+		strcpy(f->local_fname,d->d_name);
+		memset(f->fcb,' ',TPDD_FILENAME_LEN);
+		memcpy(f->fcb,e.client_fname,strlen(e.client_fname));
+		f->fcb[24] = attr;
+		f->len = st.st_size;
+		if (!place(f,&rn)) continue;
+		dbg(2,"\"%-24.24s\"  |%c|  %5u  %s\n",(char*)f->fcb,attr,f->len,f->local_fname);
+		nfiles++;
+	}
+	closedir(dir);
+	nused = rn-banks();
+	dbg(1,"Virtual disk \"%s\": %d files, %d of %d sectors\n",dir_path,nfiles,nused,nrec-banks());
+}
+
+// sector 0 (and 1 on TPDD2): the FCB table of the bank, and the SMT
+static void fill_table (int b, uint8_t* d) {
+	int rn;
+	if (!b) for (int i=0;i<nfiles;i++) memcpy(d+i*IMG_FCB_LEN,files[i].fcb,IMG_FCB_LEN);
+	for (rn=0;rn<banks()+nused;rn++) d[SMT_OFFSET+(model==2?rn:rn*2)/8] |= 0x80>>(model==2?rn:rn*2)%8;
+	d[SMT_OFFSET+IMG_SMT_LEN] = nused;
+}
+
+static void fill_data (DIR_FILE* f, int k, uint8_t* d) {
+	int fd, n = f->len-k*SECTOR_DATA_LEN;
+	if (n>SECTOR_DATA_LEN) n = SECTOR_DATA_LEN;
+	if ((fd = openat(dir_fd,f->local_fname,O_RDONLY))<0) {
+		dbg(0,"%s: %s\n",f->local_fname,strerror(errno));
+		return;
+	}
+	if (pread(fd,d,n,(off_t)k*SECTOR_DATA_LEN)<0) dbg(0,"%s: %s\n",f->local_fname,strerror(errno));
+	close(fd);
+}
+
+// DISK_IMG_FILL, record headers like req_format() and img_fs.c make them
+static void fill (int rn, uint8_t* r, bool data) {
+	int i;
+	if (!nrec) layout();
+	i = rn<DIR_RECS ? sec_file[rn] : -1;
+
+	memset(r,0x00,SECTOR_HEADER_LEN);
+	if (model==2) {
+		r[0] = 0x16;
+		if (rn<banks()) r[1] = 0xFF;
+	} else if (rn>=banks() && i<0) r[0] = 1; // LSC
+	if (i>=0) r[1] = rn+1<DIR_RECS && sec_file[rn+1]==i ? rn+1 : 0xFF;
+
+	if (!data) return;
+	if (rn<banks()) fill_table(rn,r+SECTOR_HEADER_LEN);
+	else if (i>=0) fill_data(&files[i],rn-files[i].head,r+SECTOR_HEADER_LEN);
+}
+
+// select directory d as the disk
+int img_dir_open (const char* d) {
+	if (dir_fd>=0) close(dir_fd);
+	nrec = 0;
+	strncpy(dir_path,d,PATH_MAX);
+	if ((dir_fd = open(d,O_RDONLY|O_DIRECTORY|O_CLOEXEC))<0) return -1;
+	return disk_img_virtual(model==2?PDD2_IMG_LEN:PDD1_IMG_LEN,fill);
+}
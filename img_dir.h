@@ -0,0 +1,8 @@
+// Virtual disk image of a directory, see img_dir.c
+
+#ifndef IMG_DIR_H
+#define IMG_DIR_H
+
+int img_dir_open (const char* dir);
+
+#endif
@@ -0,0 +1,406 @@
+// Files inside the disk image
+//
+// When the disk image (-i) holds a TPDD filesystem, the Operation-mode
+// file commands work on the files in the image instead of the share
+// directory, the same way a real drive works on the disk. An image that
+// doesn't hold a filesystem, like the Sardine dictionary, or that doesn't
+// exist yet, leaves the file commands on the share directory.
+//
+// The layout, as found on disks written by real drives:
+//
+//   Sector 0 holds the FCB table, DIRENTS FCBs of IMG_FCB_LEN bytes:
+//     0-23 name, 24 attr, 25-26 length MSB first, 27-28 0,
+//     29 first sector, 30 last sector
+//   followed at SMT_OFFSET by the SMT, a bitmap of the sectors in use,
+//   MSB first, 2 bits per sector on TPDD1 and 1 on TPDD2, and then the
+//   number of sectors used by files.
+//   TPDD2 has the bank 0 table in sector 0 and the bank 1 table in
+//   sector 1, and the same SMT in both.
+//   Every sector of a file has the number of the next one in the first
+//   byte of its ID, 0xFF in the last one.
+//
+// The bundled utility disks were written sector by sector from a master,
+// and their ID bytes don't link anything, but all of their files are
+// contiguous. So a file that fits exactly between its first and last
+// sectors is taken to be contiguous, and only other files follow the links.
+// Any file that gets appended to is re-linked properly.
+//
+// The FCB tables and the SMT are parsed into fcb[][], an FCB hash index,
+// and an allocation bitmap, and parsed again only when something else
+// changed the image, see disk_img_gen(). Everything here runs with the
+// image locked through open_disk_image(), and is shared by all sessions
+// like the image itself.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <fcntl.h>
+
+#include "fnv1a.h"
+#include "tpdd.h"
+#include "disk_img.h"
+#include "img_fs.h"
+
+#define IMG_RECS  (PDD2_TRACKS*PDD2_SECTORS)
+#define IMG_INDEX 128 // power of 2, more than 2x DIRENTS
+
+typedef struct {
+	char name[TPDD_FILENAME_LEN+1]; // trailing spaces removed, "" = free FCB
+	uint8_t attr;
+	uint16_t len;
+	uint8_t head;
+	uint8_t tail;
+} IMG_FCB;
+
+static IMG_FCB fcb[2][DIRENTS];
+static uint8_t fcb_index[2][IMG_INDEX]; // FCB number +1, 0 = empty slot
+static uint8_t used[IMG_RECS/8];        // allocation bitmap, 1 bit per sector
+static uint8_t dirty[IMG_RECS/8];       // sectors to commit
+static int nrec = 0;                    // sectors, 0 = no filesystem
+static int nfree = 0;
+static unsigned gen = UINT_MAX;         // disk_img_gen() of the parse
+
+static int banks (void) {
+	return model==2 ? 2 : 1;
+}
+
+static bool bit (const uint8_t* m, int n) {
+	return m[n/8] & 0x80>>n%8;
+}
+
+static void bit_set (uint8_t* m, int n, bool v) {
+	if (v) m[n/8] |= 0x80>>n%8;
+	else m[n/8] &= ~(0x80>>n%8);
+}
+
+// where sector rn is in the SMT bitmap
+static int smt_bit (int rn) {
+	return model==2 ? rn : rn*2;
+}
+
+static uint8_t* rec_data (int rn) {
+	return disk_img_rec(rn)+SECTOR_HEADER_LEN;
+}
+
+/* FNV-1a over the name and the attr, same as dir_list.c */
+static uint32_t hash (const char* name, uint8_t attr) {
+	return fnv1a_add(fnv1a(name,strlen(name)),&attr,1);
+}
+
+static void index_build (int b) {
+	unsigned i, s;
+	memset(fcb_index[b],0,IMG_INDEX);
+	for (i=0;i<DIRENTS;i++) {
+		if (!fcb[b][i].name[0]) continue;
+		for (s=hash(fcb[b][i].name,fcb[b][i].attr);fcb_index[b][s&(IMG_INDEX-1)];s++);
+		fcb_index[b][s&(IMG_INDEX-1)] = i+1;
+	}
+}
+
+// FCB number of name+attr in bank b, -1 if none
+static int fcb_find (int b, const char* name, uint8_t attr) {
+	unsigned s = hash(name,attr);
+	IMG_FCB* f;
+	for (;fcb_index[b][s&(IMG_INDEX-1)];s++) {
+		f = &fcb[b][fcb_index[b][s&(IMG_INDEX-1)]-1];
+		if (f->attr==attr && !strcmp(f->name,name)) return f-fcb[b];
+	}
+	return -1;
+}
+
+// Parse the FCB tables and the SMT, unless nothing changed since the last time.
+// The image is only taken to hold a filesystem if the FCBs make sense and
+// the used sectors count agrees with the bitmap.
+static void img_load (void) {
+	uint8_t* p;
+	int b, i, rn, n = 0;
+
+	if (gen==disk_img_gen()) return;
+	gen = disk_img_gen();
+	memset(fcb,0,sizeof(fcb));
+	memset(fcb_index,0,sizeof(fcb_index));
+	memset(used,0,sizeof(used));
+	nfree = 0;
+	nrec = disk_img_len()/SECTOR_LEN;
+	if (nrec>(model==2?PDD2_TRACKS*PDD2_SECTORS:PDD1_TRACKS*PDD1_SECTORS))
+		nrec = model==2?PDD2_TRACKS*PDD2_SECTORS:PDD1_TRACKS*PDD1_SECTORS;
+	if (nrec<=banks()) { nrec = 0; return; }
+
+	p = rec_data(0)+SMT_OFFSET;
+	for (rn=0;rn<nrec;rn++) {
+		if (model==1 && bit(p,rn*2+1)) break;
+		if (bit(p,smt_bit(rn))) { bit_set(used,rn,1); if (rn>=banks()) n++; }
+		else if (rn>=banks()) nfree++;
+	}
+	if (rn<nrec || n!=p[IMG_SMT_LEN]) {
+		dbg(2,"Disk image: no filesystem\n");
+		nrec = 0;
+		return;
+	}
+
+	for (b=0;b<banks();b++) {
+		p = rec_data(b);
+		for (i=0;i<DIRENTS;i++,p+=IMG_FCB_LEN) {
+			if (!p[0]) continue;
+			if (p[27] || p[28] || p[29]>=nrec || p[30]>=nrec) {
+				dbg(2,"Disk image: bad FCB %d\n",i);
+				nrec = 0;
+				return;
+			}
+			memcpy(fcb[b][i].name,p,TPDD_FILENAME_LEN);
+			for (n=TPDD_FILENAME_LEN;n>0 && (fcb[b][i].name[n-1]==' ' || !fcb[b][i].name[n-1]);n--) fcb[b][i].name[n-1] = 0x00;
+			fcb[b][i].attr = p[24];
+			fcb[b][i].len = p[25]<<8 | p[26];
+			fcb[b][i].head = p[29];
+			fcb[b][i].tail = p[30];
+		}
+		index_build(b);
+	}
+}
+
+// the sectors of f in order, returns how many
+static int fcb_chain (IMG_FCB* f, uint8_t* s) {
+	int k = (f->len+SECTOR_DATA_LEN-1)/SECTOR_DATA_LEN;
+	int i, n = 0, rn = f->head;
+	if (f->tail-f->head+1==k) {
+		for (;n<k;n++) s[n] = f->head+n;
+		return k;
+	}
+	while (n<k && rn<nrec && bit(used,rn)) {
+		for (i=0;i<n;i++) if (s[i]==rn) return n; // loop
+		s[n++] = rn;
+		rn = disk_img_rec(rn)[1];
+	}
+	return n;
+}
+
+// write f back into its FCB
+static void fcb_store (int b, int i) {
+	uint8_t* p = disk_img_rec_w(b)+SECTOR_HEADER_LEN+i*IMG_FCB_LEN;
+	IMG_FCB* f = &fcb[b][i];
+	memset(p,0x00,IMG_FCB_LEN);
+	if (f->name[0]) {
+		memset(p,' ',TPDD_FILENAME_LEN);
+		memcpy(p,f->name,strlen(f->name));
+		p[24] = f->attr;
+		p[25] = f->len>>8;
+		p[26] = f->len&0xFF;
+		p[29] = f->head;
+		p[30] = f->tail;
+	}
+	bit_set(dirty,b,1);
+}
+
+// write the allocation bitmap back into the SMT, in every bank
+static void smt_store (void) {
+	uint8_t* p;
+	int b, rn, n = 0;
+	for (rn=banks();rn<nrec;rn++) n += bit(used,rn);
+	for (b=0;b<banks();b++) {
+		p = disk_img_rec_w(b)+SECTOR_HEADER_LEN+SMT_OFFSET;
+		memset(p,0x00,IMG_SMT_LEN);
+		for (rn=0;rn<nrec;rn++) if (bit(used,rn)) bit_set(p,smt_bit(rn),1);
+		p[IMG_SMT_LEN] = n;
+		bit_set(dirty,b,1);
+	}
+}
+
+// commit everything written, without parsing it all again
+static void img_commit (void) {
+	for (int rn=0;rn<nrec;rn++) if (bit(dirty,rn)) disk_img_commit(rn);
+	memset(dirty,0,sizeof(dirty));
+	gen = disk_img_gen();
+}
+
+// append n bytes to FCB i in bank b, taking the lowest free sectors as needed
+static uint8_t fcb_append (int b, int i, const uint8_t* d, int n) {
+	IMG_FCB* f = &fcb[b][i];
+	uint8_t s[IMG_RECS];
+	uint8_t* r;
+	int k = fcb_chain(f,s), o = f->len, c, j, rn;
+	int nk = (o+n+SECTOR_DATA_LEN-1)/SECTOR_DATA_LEN;
+
+	if (o+n>IMG_FILE_MAX) return ERR_FILE_LEN;
+	if (k<(o+SECTOR_DATA_LEN-1)/SECTOR_DATA_LEN) return ERR_SECTOR_NUM; // broken chain
+	if (nk-k>nfree) return ERR_DISK_FULL;
+
+	if (nk>k) {
+		for (j=k,rn=banks();j<nk;rn++) {
+			if (bit(used,rn)) continue;
+			bit_set(used,rn,1);
+			nfree--;
+			r = disk_img_rec_w(rn);
+			if (model==1 && r[0]==1) r[0] = 0; // TPDD1 LSC, see req_format()
+			memset(r+SECTOR_HEADER_LEN,0x00,SECTOR_DATA_LEN);
+			s[j++] = rn;
+		}
+		for (j=0;j<nk;j++) {
+			disk_img_rec_w(s[j])[1] = j+1<nk ? s[j+1] : 0xFF;
+			bit_set(dirty,s[j],1);
+		}
+		f->head = s[0];
+		f->tail = s[nk-1];
+		smt_store();
+	}
+
+	while (n>0) {
+		j = o/SECTOR_DATA_LEN;
+		c = SECTOR_DATA_LEN-o%SECTOR_DATA_LEN;
+		if (c>n) c = n;
+		memcpy(disk_img_rec_w(s[j])+SECTOR_HEADER_LEN+o%SECTOR_DATA_LEN,d,c);
+		bit_set(dirty,s[j],1);
+		o += c; d += c; n -= c;
+	}
+	f->len = o;
+	fcb_store(b,i);
+	return ERR_SUCCESS;
+}
+
+static void fcb_free (int b, int i) {
+	uint8_t s[IMG_RECS];
+	int k = fcb_chain(&fcb[b][i],s);
+	while (k--) if (bit(used,s[k])) { bit_set(used,s[k],0); nfree++; }
+	memset(&fcb[b][i],0x00,sizeof(IMG_FCB));
+	fcb_store(b,i);
+	smt_store();
+	index_build(b);
+}
+
+static int ses_bank (SESSION* ses) {
+	return model==2 ? ses->bank : 0;
+}
+
+// a FILE_LIST entry for a file in the image, the name as it is in the FCB
+void img_fs_entry (FILE_ENTRY* e, const char* name, uint8_t attr, uint16_t len) {
+	memset(e,0x00,sizeof(FILE_ENTRY));
+	strncpy(e->client_fname,name,TPDD_FILENAME_LEN);
+	strncpy(e->local_fname,name,TPDD_FILENAME_LEN);
+	e->attr = attr;
+	e->len = len;
+	e->flags = FE_FLAGS_IMG;
+}
+
+// Fill ses->files from the FCB table of the current bank.
+// Returns -1 if there is no image or it doesn't hold a filesystem.
+int img_fs_list (SESSION* ses) {
+	FILE_ENTRY e;
+	int b = ses_bank(ses), i;
+	if (open_disk_image(ses,0,O_RDONLY)) return -1;
+	if (disk_img_is_virtual()) { close_disk_image(ses); return -1; } // img_dir.c, it's the share
+	img_load();
+	if (!nrec) { close_disk_image(ses); return -1; }
+	file_list_clear_all(&ses->files);
+	dbg(1,"\nDisk image %s: %s\n",model==2?b?"[Bank 1]":"[Bank 0]":"",disk_img_fname);
+	for (i=0;i<DIRENTS;i++) {
+		if (!fcb[b][i].name[0]) continue;
+		img_fs_entry(&e,fcb[b][i].name,fcb[b][i].attr,fcb[b][i].len);
+		add_file(&ses->files,&e);
+		dbg(2,"\"%-24s\"  |%c|  %5u\n",e.client_fname,e.attr,e.len);
+	}
+	ses->dirent_free = nfree;
+	close_disk_image(ses);
+	return 0;
+}
+
+// open ses->cur_file, reading the whole file into ra_buf[] for F_OPEN_READ
+uint8_t img_fs_open (SESSION* ses, uint8_t mode) {
+	FILE_ENTRY* c = ses->cur_file;
+	int b = ses_bank(ses), i;
+	uint8_t e, s[IMG_RECS];
+
+	if (!c) return ERR_NO_FNAME;
+	if (mode!=F_OPEN_WRITE && mode!=F_OPEN_APPEND && mode!=F_OPEN_READ) return ERR_PARAM;
+	if ((e = open_disk_image(ses,0,mode==F_OPEN_READ?O_RDONLY:O_RDWR))) return e;
+	img_load();
+	i = nrec ? fcb_find(b,c->client_fname,c->attr) : -1;
+
+	if (!nrec) e = ERR_DISK_NOINIT;
+	else switch (mode) {
+		case F_OPEN_WRITE:
+			if (i>=0) { e = ERR_FMT_MISMATCH; break; }
+			for (i=0;i<DIRENTS && fcb[b][i].name[0];i++);
+			if (i==DIRENTS) { e = ERR_DIR_FULL; break; }
+			snprintf(fcb[b][i].name,sizeof(fcb[b][i].name),"%s",c->client_fname);
+			fcb[b][i].attr = c->attr;
+			fcb_store(b,i);
+			index_build(b);
+			break;
+		case F_OPEN_APPEND:
+			if (i<0) e = ERR_FMT_MISMATCH;
+			break;
+		default:
+			if (i<0) { e = ERR_NO_FILE; break; }
+			ses->ra_head = ses->ra_tail = 0;
+			for (int j=0,k=fcb_chain(&fcb[b][i],s);j<k && ses->ra_tail<fcb[b][i].len;j++) {
+				int n = fcb[b][i].len-ses->ra_tail;
+				if (n>SECTOR_DATA_LEN) n = SECTOR_DATA_LEN;
+				memcpy(ses->ra_buf+ses->ra_tail,rec_data(s[j]),n);
+				ses->ra_tail += n;
+			}
+	}
+
+	if (!e) {
+		ses->img_bank = b;
+		ses->img_attr = c->attr;
+		snprintf(ses->img_name,sizeof(ses->img_name),"%s",c->client_fname);
+		ses->f_open_mode = mode;
+		ses->wb_len = 0;
+	}
+	img_commit();
+	close_disk_image(ses);
+	return e;
+}
+
+// append to the open file, from wb_flush()
+uint8_t img_fs_write (SESSION* ses, const uint8_t* d, int n) {
+	uint8_t e;
+	int i;
+	if ((e = open_disk_image(ses,0,O_RDWR))) return e;
+	if (ses->img_bank<0) { // the disk was changed, see disk_check()
+		close_disk_image(ses);
+		return ERR_NO_FILE;
+	}
+	img_load();
+	i = nrec ? fcb_find(ses->img_bank,ses->img_name,ses->img_attr) : -1;
+	e = i<0 ? ERR_NO_FILE : fcb_append(ses->img_bank,i,d,n);
+	img_commit();
+	close_disk_image(ses);
+	return e;
+}
+
+uint8_t img_fs_delete (SESSION* ses) {
+	int b = ses_bank(ses), i;
+	uint8_t e;
+	if (!ses->cur_file) return ERR_NO_FNAME;
+	if ((e = open_disk_image(ses,0,O_RDWR))) return e;
+	img_load();
+	i = nrec ? fcb_find(b,ses->cur_file->client_fname,ses->cur_file->attr) : -1;
+	if (i<0) e = ERR_NO_FILE;
+	else fcb_free(b,i);
+	img_commit();
+	close_disk_image(ses);
+	return e;
+}
+
+uint8_t img_fs_rename (SESSION* ses, const char* name) {
+	int b = ses_bank(ses), i;
+	uint8_t e;
+	if (!ses->cur_file) return ERR_NO_FNAME;
+	if ((e = open_disk_image(ses,0,O_RDWR))) return e;
+	img_load();
+	i = nrec ? fcb_find(b,ses->cur_file->client_fname,ses->cur_file->attr) : -1;
+	if (i<0) e = ERR_NO_FILE;
+	else if (fcb_find(b,name,fcb[b][i].attr)>=0) e = ERR_EXISTS;
+	else {
+		memset(fcb[b][i].name,0x00,sizeof(fcb[b][i].name));
+		strncpy(fcb[b][i].name,name,TPDD_FILENAME_LEN);
+		fcb_store(b,i);
+		index_build(b);
+	}
+	img_commit();
+	close_disk_image(ses);
+	return e;
+}
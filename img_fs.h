@@ -0,0 +1,20 @@
+// Files inside the disk image, see img_fs.c
+
+#ifndef IMG_FS_H
+#define IMG_FS_H
+
+#include <stdint.h>
+#include "tpdd.h"
+
+#define IMG_FCB_LEN   31     // one FCB in the table in sector 0
+#define IMG_SMT_LEN   20     // SMT bitmap bytes, followed by the used sectors count
+#define IMG_FILE_MAX  65534  // real drive limit
+
+int  img_fs_list (SESSION* ses);
+void img_fs_entry (FILE_ENTRY* e, const char* name, uint8_t attr, uint16_t len);
+uint8_t img_fs_open (SESSION* ses, uint8_t mode);
+uint8_t img_fs_write (SESSION* ses, const uint8_t* d, int n);
+uint8_t img_fs_delete (SESSION* ses);
+uint8_t img_fs_rename (SESSION* ses, const char* name);
+
+#endif
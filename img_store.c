@@ -0,0 +1,257 @@
+// Disk images kept in memory
+//
+// -L loads every disk image in a directory into memory at startup, so that
+// -i can pick any of them without mapping the file. An archive of images
+// is mostly the same records over and over: all zeros, fresh format
+// headers, the same utility files. So an image here is just a table of
+// pointers to records, and each distinct record is kept once, found by a
+// hash of its contents, with a count of how many places use it.
+//
+// A record in the table may be shared, so it's never written in place.
+// img_store_rec_w() first gives the image its own copy of the record, or
+// just takes the record out of the table if nothing else uses it.
+// img_store_commit() puts it back into the table, where it may turn out to
+// be the same as some other record again, and writes it to the image file.
+//
+// Nothing here locks. Images are loaded at startup, and after that
+// disk_img.c only calls in with the image locked.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+#include "fnv1a.h"
+#include "img_store.h"
+
+typedef struct STORE_REC {
+	struct STORE_REC* next; // hash chain
+	uint32_t hash;
+	uint32_t refs;
+	bool hashed;            // in the table, so maybe shared
+	uint8_t d[SECTOR_LEN];
+} STORE_REC;
+
+struct STORE_IMG {
+	char path[PATH_MAX+1];
+	int nrec;
+	bool wp;
+	STORE_REC** rec;
+};
+
+#define TBL_MIN 1024 // power of 2
+
+static STORE_REC** tbl = NULL;
+static size_t tbl_len = 0;  // buckets
+static size_t tbl_n = 0;    // records in the table
+static STORE_IMG** imgs = NULL;
+static unsigned nimgs = 0;
+static size_t nrecs = 0;    // records in all the images
+
+static uint32_t rec_hash (const uint8_t* d) {
+	return fnv1a(d,SECTOR_LEN);
+}
+
+static int tbl_grow (void) {
+	size_t n = tbl_len ? tbl_len*2 : TBL_MIN, i;
+	STORE_REC** t = calloc(n,sizeof(STORE_REC*));
+	STORE_REC *r, *nx;
+	if (!t) return -1;
+	for (i=0;i<tbl_len;i++) for (r=tbl[i];r;r=nx) {
+		nx = r->next;
+		r->next = t[r->hash&(n-1)];
+		t[r->hash&(n-1)] = r;
+	}
+	free(tbl);
+	tbl = t;
+	tbl_len = n;
+	return 0;
+}
+
+static STORE_REC* tbl_find (uint32_t h, const uint8_t* d) {
+	if (!tbl_len) return NULL;
+	for (STORE_REC* r=tbl[h&(tbl_len-1)];r;r=r->next)
+		if (r->hash==h && !memcmp(r->d,d,SECTOR_LEN)) return r;
+	return NULL;
+}
+
+static void tbl_remove (STORE_REC* r) {
+	STORE_REC** p = &tbl[r->hash&(tbl_len-1)];
+	while (*p && *p!=r) p = &(*p)->next;
+	if (*p) *p = r->next;
+	r->next = NULL;
+	r->hashed = false;
+	tbl_n--;
+}
+
+// The shared record with the same contents as private record r, which
+// is then freed, or r itself, now in the table.
+static STORE_REC* intern (STORE_REC* r) {
+	STORE_REC* p;
+	r->hash = rec_hash(r->d);
+	if ((p = tbl_find(r->hash,r->d))) {
+		p->refs++;
+		free(r);
+		return p;
+	}
+	if (tbl_n>=tbl_len && tbl_grow() && !tbl_len) return r; // stays private
+	r->next = tbl[r->hash&(tbl_len-1)];
+	tbl[r->hash&(tbl_len-1)] = r;
+	r->hashed = true;
+	tbl_n++;
+	return r;
+}
+
+// path resolved, so that the same file is always found the same way,
+// or as given if the file is gone since it was loaded
+static bool key (const char* fname, char* p) {
+	if (realpath(fname,p)) return true;
+	if (errno!=ENOENT) return false;
+	snprintf(p,PATH_MAX+1,"%s",fname);
+	return true;
+}
+
+STORE_IMG* img_store_find (const char* fname) {
+	char p[PATH_MAX+1];
+	if (!nimgs || !key(fname,p)) return NULL;
+	for (unsigned i=0;i<nimgs;i++) if (!strcmp(imgs[i]->path,p)) return imgs[i];
+	return NULL;
+}
+
+// the i'th image loaded, NULL past the last one
+STORE_IMG* img_store_get (unsigned i) {
+	return i<nimgs ? imgs[i] : NULL;
+}
+
+// Load image file fname, or find it if it's already loaded.
+// NULL with errno set if it can't be read.
+STORE_IMG* img_store_load (const char* fname) {
+	STORE_IMG* s;
+	STORE_IMG** t;
+	STORE_REC* r;
+	struct stat st;
+	uint8_t* b = NULL;
+	int fd, rn;
+
+	if ((s = img_store_find(fname))) return s;
+	if ((fd = open(fname,O_RDONLY|O_CLOEXEC))<0) return NULL;
+	if (fstat(fd,&st) || st.st_size<SECTOR_LEN || st.st_size%SECTOR_LEN
+		|| !(b = malloc(st.st_size)) || read(fd,b,st.st_size)!=st.st_size
+		|| !(s = calloc(1,sizeof(STORE_IMG)))
+		|| !(t = realloc(imgs,(nimgs+1)*sizeof(STORE_IMG*)))) {
+		close(fd);
+		free(b);
+		free(s);
+		return NULL;
+	}
+	close(fd);
+	imgs = t;
+	key(fname,s->path);
+	s->wp = access(s->path,W_OK)!=0;
+	s->nrec = st.st_size/SECTOR_LEN;
+	if (!(s->rec = calloc(s->nrec,sizeof(STORE_REC*)))) { free(b); free(s); return NULL; }
+
+	for (rn=0;rn<s->nrec;rn++) {
+		uint8_t* d = b+rn*SECTOR_LEN;
+		uint32_t h = rec_hash(d);
+		if ((r = tbl_find(h,d))) { r->refs++; s->rec[rn] = r; continue; }
+		if (!(r = calloc(1,sizeof(STORE_REC)))) break;
+		memcpy(r->d,d,SECTOR_LEN);
+		r->refs = 1;
+		s->rec[rn] = intern(r);
+	}
+	free(b);
+	s->nrec = rn; // short if out of memory
+	nrecs += rn;
+	imgs[nimgs++] = s;
+	return s;
+}
+
+// Load every file in dir that's the size of a disk image.
+// Returns how many, -1 if dir can't be read.
+int img_store_load_dir (const char* dir) {
+	char p[PATH_MAX+1];
+	struct dirent* d;
+	struct stat st;
+	DIR* dp;
+	int n = 0;
+	if (!(dp = opendir(dir))) return -1;
+	while ((d = readdir(dp))) {
+		if (d->d_name[0]=='.') continue;
+		if (strlen(dir)+strlen(d->d_name)+1>PATH_MAX) continue;
+		strcpy(p,dir);
+		strcat(p,"/");
+		strcat(p,d->d_name);
+		if (stat(p,&st) || !S_ISREG(st.st_mode)) continue;
+		if (st.st_size!=PDD1_IMG_LEN && st.st_size!=PDD2_IMG_LEN) continue;
+		if (img_store_load(p)) n++;
+	}
+	closedir(dp);
+	return n;
+}
+
+// images, their records, and how many of those are kept
+void img_store_stats (unsigned* images, size_t* records, size_t* unique) {
+	*images = nimgs;
+	*records = nrecs;
+	*unique = tbl_n;
+}
+
+size_t img_store_len (STORE_IMG* s) {
+	return (size_t)s->nrec*SECTOR_LEN;
+}
+
+int img_store_wp (STORE_IMG* s) {
+	return s->wp;
+}
+
+const char* img_store_path (STORE_IMG* s) {
+	return s->path;
+}
+
+uint8_t* img_store_rec (STORE_IMG* s, int rn) {
+	if (rn<0 || rn>=s->nrec) return NULL;
+	return s->rec[rn]->d;
+}
+
+// record rn, the image's own, to write to
+uint8_t* img_store_rec_w (STORE_IMG* s, int rn) {
+	STORE_REC *r, *c;
+	if (s->wp || rn<0 || rn>=s->nrec) return NULL;
+	r = s->rec[rn];
+	if (!r->hashed) return r->d;
+	if (r->refs==1) { tbl_remove(r); return r->d; }
+	if (!(c = malloc(sizeof(STORE_REC)))) return NULL;
+	memcpy(c->d,r->d,SECTOR_LEN);
+	c->next = NULL;
+	c->refs = 1;
+	c->hashed = false;
+	r->refs--;
+	s->rec[rn] = c;
+	return c->d;
+}
+
+// Share record rn again, rn<0 = all of them, and write it to the image
+// file, waiting for it to be on the disk if wait. -1 if the write failed.
+int img_store_commit (STORE_IMG* s, int rn, int wait) {
+	int i = rn<0 ? 0 : rn, e = rn<0 ? s->nrec : rn+1, fd, r = 0;
+	if (s->wp || i>=s->nrec) return -1;
+	if ((fd = open(s->path,O_WRONLY|O_CLOEXEC))<0) r = -1;
+	for (;i<e && i<s->nrec;i++) {
+		if (!s->rec[i]->hashed) s->rec[i] = intern(s->rec[i]);
+		if (fd>=0 && pwrite(fd,s->rec[i]->d,SECTOR_LEN,(off_t)i*SECTOR_LEN)!=SECTOR_LEN) r = -1;
+	}
+	if (fd>=0) {
+		if (wait && fdatasync(fd)) r = -1;
+		close(fd);
+	}
+	return r;
+}
@@ -0,0 +1,24 @@
+// Disk images kept in memory, see img_store.c
+
+#ifndef IMG_STORE_H
+#define IMG_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct STORE_IMG STORE_IMG;
+
+int  img_store_load_dir (const char* dir);
+STORE_IMG* img_store_load (const char* fname);
+STORE_IMG* img_store_find (const char* fname);
+STORE_IMG* img_store_get (unsigned i);
+void img_store_stats (unsigned* images, size_t* records, size_t* unique);
+
+size_t img_store_len (STORE_IMG* s);
+int  img_store_wp (STORE_IMG* s);
+const char* img_store_path (STORE_IMG* s);
+uint8_t* img_store_rec (STORE_IMG* s, int rn);
+uint8_t* img_store_rec_w (STORE_IMG* s, int rn);
+int  img_store_commit (STORE_IMG* s, int rn, int sync);
+
+#endif
@@ -0,0 +1,236 @@
+// Request counters and latency histograms
+//
+// Every request handled by get_opr_cmd() and get_fdc_cmd() is counted
+// by command: how many, bytes in and out, error responses by code, and
+// how long it took from the whole request being received to the handler
+// returning. Directory rebuilds and disk image access get a histogram
+// each as well.
+//
+// Histograms are log-linear like HDR histograms: exact below STAT_SUB us,
+// then STAT_SUB buckets per power of 2 above that, so any value is
+// within 1/STAT_SUB of its bucket. Recording is a few relaxed atomic adds
+// and no locks, from any thread, so it's always on.
+//
+// The totals are written out as text on SIGUSR1 (to the log), and to
+// anything that connects to the unix socket given to stats_start(), eg:
+//   socat - UNIX-CONNECT:/tmp/dl.stats
+//   nc -U /tmp/dl.stats
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tpdd.h"
+#include "stats.h"
+
+STAT_OP stat_opr[STAT_OPR_LEN];
+STAT_OP stat_fdc[sizeof(FDC_CMDS)]; // the last one is for invalid commands
+STAT_HIST stat_dir;
+STAT_HIST stat_disk;
+
+static const char* stat_opr_names[STAT_OPR_LEN] = {
+	[REQ_DIRENT] = "dirent",
+	[REQ_OPEN] = "open",
+	[REQ_CLOSE] = "close",
+	[REQ_READ] = "read",
+	[REQ_WRITE] = "write",
+	[REQ_DELETE] = "delete",
+	[REQ_FORMAT] = "format",
+	[REQ_STATUS] = "status",
+	[REQ_FDC] = "fdc",
+	[REQ_CONDITION] = "condition",
+	[REQ_RENAME] = "rename",
+	[REQ_VERSION] = "version",
+	[REQ_CACHE] = "cache",
+	[REQ_MEM_WRITE] = "mem_write",
+	[REQ_MEM_READ] = "mem_read",
+	[REQ_SYSINFO] = "sysinfo",
+	[REQ_EXEC] = "exec",
+	[STAT_OPR_LEN-1] = "other", // and anything above
+};
+
+static const char* stat_fdc_names[sizeof(FDC_CMDS)] = {
+	"set_mode", "condition", "format", "format_nv", "read_id", "read_sector",
+	"search_id", "write_id", "write_id_nv", "write_sector", "write_sector_nv",
+	"invalid"
+};
+
+static long stat_t0;
+static char stat_sock[PATH_MAX+1];
+static int stat_fd = -1;
+static int stat_sig_fd[2] = {-1,-1};
+static pthread_t stat_thread;
+
+static int stat_bucket(unsigned long v) {
+	int e;
+	if (v<STAT_SUB) return v;
+	if (v>>STAT_MAX_BITS) return STAT_BUCKETS-1;
+	for (e=STAT_SUB_BITS;v>>(e+1);e++);
+	return (e-STAT_SUB_BITS+1)*STAT_SUB + ((v>>(e-STAT_SUB_BITS))&(STAT_SUB-1));
+}
+
+// highest value that lands in bucket i
+static unsigned long stat_bucket_max(int i) {
+	int e = i/STAT_SUB+STAT_SUB_BITS-1;
+	if (i<STAT_SUB) return i;
+	return ((unsigned long)(STAT_SUB+i%STAT_SUB+1)<<(e-STAT_SUB_BITS))-1;
+}
+
+void stats_time(STAT_HIST* h, long us) {
+	unsigned long v = us<0 ? 0 : us;
+	unsigned long m = atomic_load_explicit(&h->max,memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->n[stat_bucket(v)],1,memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count,1,memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum,v,memory_order_relaxed);
+	while (v>m && !atomic_compare_exchange_weak_explicit(&h->max,&m,v,memory_order_relaxed,memory_order_relaxed));
+}
+
+// one request, that started at t, err<=0 for no error
+void stats_req(STAT_OP* o, long t, unsigned in, unsigned out, int err) {
+	stats_time(&o->t,now_us()-t);
+	atomic_fetch_add_explicit(&o->in,in,memory_order_relaxed);
+	atomic_fetch_add_explicit(&o->out,out,memory_order_relaxed);
+	if (err>0) atomic_fetch_add_explicit(&o->err[err&0xFF],1,memory_order_relaxed);
+}
+
+STAT_OP* stats_fdc_op(uint8_t c) {
+	const char* p = c ? memchr(FDC_CMDS,c,sizeof(FDC_CMDS)-1) : NULL;
+	return &stat_fdc[p ? p-FDC_CMDS : sizeof(FDC_CMDS)-1];
+}
+
+// value at percentile p, as the top of its bucket, but no more than max
+static unsigned long stat_pct(const STAT_HIST* h, unsigned long c, double p) {
+	unsigned long r = 0, k = (unsigned long)(c*p/100.0), m = atomic_load(&h->max);
+	if (k>=c) k = c-1;
+	for (int i=0;i<STAT_BUCKETS;i++)
+		if ((r += atomic_load_explicit(&h->n[i],memory_order_relaxed))>k) return MIN(stat_bucket_max(i),m);
+	return m;
+}
+
+static void stat_line(FILE* f, const char* mode, const char* name, const STAT_HIST* h, const STAT_OP* o) {
+	unsigned long c = atomic_load_explicit(&h->count,memory_order_relaxed);
+	if (!c) return;
+	fprintf(f,"%-4s %-16s %9lu",mode,name,c);
+	if (o) fprintf(f," %10lu %10lu",atomic_load(&o->in),atomic_load(&o->out));
+	else fprintf(f," %10s %10s","-","-");
+	fprintf(f," %9lu %9lu %9lu %9lu %9lu\n",
+		atomic_load(&h->sum)/c,stat_pct(h,c,50),stat_pct(h,c,90),stat_pct(h,c,99),atomic_load(&h->max));
+	if (!o) return;
+	for (int i=1;i<256;i++) {
+		unsigned long n = atomic_load_explicit(&o->err[i],memory_order_relaxed);
+		if (n) fprintf(f,"%-4s   error %02X %22lu\n","",i,n);
+	}
+}
+
+// all the totals as text
+void stats_write(FILE* f) {
+	char n[8];
+	unsigned i;
+	fprintf(f,"%s stats, pid %d, up %ld s\n",APP_NAME,(int)getpid(),(now_us()-stat_t0)/1000000L);
+	fprintf(f,"%-4s %-16s %9s %10s %10s %9s %9s %9s %9s %9s\n","mode","request","count","bytes_in","bytes_out","avg_us","p50_us","p90_us","p99_us","max_us");
+	for (i=0;i<STAT_OPR_LEN;i++) {
+		if (!stat_opr_names[i]) snprintf(n,sizeof(n),"0x%02X",i);
+		stat_line(f,"opr",stat_opr_names[i]?stat_opr_names[i]:n,&stat_opr[i].t,&stat_opr[i]);
+	}
+	for (i=0;i<sizeof(FDC_CMDS);i++) stat_line(f,"fdc",stat_fdc_names[i],&stat_fdc[i].t,&stat_fdc[i]);
+	stat_line(f,"-","dir rebuild",&stat_dir,NULL);
+	stat_line(f,"-","disk image",&stat_disk,NULL);
+}
+
+static void stat_sig_handler(int sig) {
+	int e = errno;
+	if (write(stat_sig_fd[1],"",1)<0) {}
+	errno = e;
+}
+
+// answer the socket and SIGUSR1
+static void* stat_main(void* arg) {
+	struct pollfd p[2] = {
+		{ .fd = stat_sig_fd[0], .events = POLLIN },
+		{ .fd = stat_fd, .events = POLLIN },
+	};
+	char* b;
+	size_t l;
+	FILE* f;
+	int h;
+
+	while (poll(p,stat_fd<0?1:2,-1)>=0 || errno==EINTR) {
+		if (p[0].revents&POLLIN) {
+			uint8_t c[16];
+			if (read(stat_sig_fd[0],c,sizeof(c))<=0) break;
+			if (!(f = open_memstream(&b,&l))) continue;
+			stats_write(f);
+			fclose(f);
+			dbg(0,"\n%s",b);
+			free(b);
+		}
+		if (stat_fd>=0 && p[1].revents&POLLIN && (h = accept(stat_fd,NULL,NULL))>=0) {
+			if ((f = fdopen(h,"w"))) { stats_write(f); fclose(f); }
+			else close(h);
+		}
+	}
+	return arg;
+}
+
+// start the SIGUSR1 handler, and serve the stats on unix socket sock if not ""
+int stats_start(const char* sock) {
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	struct sigaction sa;
+	sigset_t all, old;
+	int r = 0;
+
+	stat_t0 = now_us();
+	if (sock && *sock) {
+		if (strlen(sock)>=sizeof(a.sun_path)) { dbg(0,"stats socket path too long: \"%s\"\n",sock); return -1; }
+		strcpy(a.sun_path,sock);
+		unlink(sock);
+		if ((stat_fd = socket(AF_UNIX,SOCK_STREAM,0))<0
+			|| bind(stat_fd,(struct sockaddr*)&a,sizeof(a))
+			|| listen(stat_fd,4)) {
+			dbg(0,"stats socket \"%s\": %s\n",sock,strerror(errno));
+			if (stat_fd>=0) close(stat_fd);
+			stat_fd = -1;
+			r = -1;
+		} else {
+			fcntl(stat_fd,F_SETFD,FD_CLOEXEC);
+			strncpy(stat_sock,sock,PATH_MAX);
+			dbg(1,"Stats socket: %s\n",sock);
+		}
+	}
+
+	if (pipe(stat_sig_fd)) return -1;
+	fcntl(stat_sig_fd[1],F_SETFL,O_NONBLOCK);
+
+	// signals are for the other threads, the handler just pokes this one
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK,&all,&old);
+	if (pthread_create(&stat_thread,NULL,stat_main,NULL)) {
+		pthread_sigmask(SIG_SETMASK,&old,NULL);
+		dbg(0,"Can not start stats thread\n");
+		return -1;
+	}
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = stat_sig_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1,&sa,NULL);
+	atexit(stats_stop);
+	return r;
+}
+
+// remove the socket
+void stats_stop(void) {
+	if (stat_sock[0]) unlink(stat_sock);
+	stat_sock[0] = 0x00;
+}
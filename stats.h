@@ -0,0 +1,44 @@
+// Request counters and latency histograms, see stats.c
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+// log-linear buckets, STAT_SUB per power of 2, up to 2^STAT_MAX_BITS us
+#define STAT_SUB_BITS 3
+#define STAT_SUB      (1<<STAT_SUB_BITS)
+#define STAT_MAX_BITS 36
+#define STAT_BUCKETS  ((STAT_MAX_BITS-STAT_SUB_BITS+1)*STAT_SUB)
+
+typedef struct {
+	atomic_ulong n[STAT_BUCKETS];
+	atomic_ulong count;
+	atomic_ulong sum;
+	atomic_ulong max;
+} STAT_HIST;
+
+typedef struct {
+	STAT_HIST t;           // service time, us
+	atomic_ulong in;       // bytes from the client
+	atomic_ulong out;      // bytes to the client
+	atomic_ulong err[256]; // error responses by ERR_* / ERR_FDC_* code
+} STAT_OP;
+
+#define STAT_OPR_LEN 0x40  // Operation-mode commands, by command byte
+extern STAT_OP stat_opr[STAT_OPR_LEN];
+extern STAT_OP stat_fdc[];  // FDC-mode commands, by position in FDC_CMDS
+extern STAT_HIST stat_dir;  // directory rebuilds in update_file_list()
+extern STAT_HIST stat_disk; // disk image access, from lock to unlock
+
+void stats_time (STAT_HIST* h, long us);
+void stats_req (STAT_OP* o, long t, unsigned in, unsigned out, int err);
+STAT_OP* stats_fdc_op (uint8_t c);
+
+void stats_write (FILE* f);
+int  stats_start (const char* sock);
+void stats_stop (void);
+
+#endif
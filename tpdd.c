@@ -0,0 +1,2586 @@
+/*
+ * DeskLink for *nix (dl)
+ * Copyright (C) 2004
+ * Stephen Hurd
+ *
+ * Redistribution of modified and unmodified copies
+ * is premitted provided the copyright remains intact
+ */
+
+/*
+DeskLink+
+2005     John R. Hogerhuis Extensions and enhancements
+2019     Brian K. White - repackaging, reorganizing, bootstrap function
+2020     Kurt McCullum - TS-DOS loaders
+2022     Gabriele Gorla - TS-DOS subdirectories
+
+DeskLink2
+2023     Brian K. White - disk image files, pdd1 FDC mode, pdd2 cache & memory
+
+DeskLink2 is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License version 2 or any
+later version as published by the Free Software Foundation.  
+
+DeskLink2 is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (in the file "COPYING"); if not, write to the
+Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+MA 02111, USA.
+*/
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "fnv1a.h"
+#include "tpdd.h"
+#include "dir_cache.h"
+#include "disk_img.h"
+#include "xattr.h"
+#include "stats.h"
+#include "capture.h"
+#include "img_fs.h"
+#include "img_store.h"
+#include "img_dir.h"
+
+/*
+ * "magic" files - See ref/ur2.txt
+ * 
+ * Support for Ultimate ROM II, TSLOAD, & any other on-the-fly loaders.
+ * These filenames will always be loadable "by magic" in any cd path, even
+ * if no such filename exists anywhere in the share tree.
+ * 
+ * Whenever a client tries to request any of these filenames,
+ * after searching cwd-within-share-path as normal, then search share root, finally app_lib_dir.
+ * They will always be found in app_lib_dir if nowhere else.
+ * TODO add $XDG_DATA_HOME (~/.local/share/myapp  mac: ~/Library/myapp/)
+ * 
+ * You may add any other files you want here if you find any other software
+ * that tries to load-use-discard a file from disk like UR2 uses DOS100.CO.
+ * 
+ * Files must also be added to install target in Makefile.
+ * 
+ * This list is checked for a match every time a requested filename is not found,
+ * so keep it short.
+ * 
+ * TODO add run-time config list of filenames and search paths
+ */
+const char * magic_files[] = {
+	"DOS100.CO",
+	"DOS200.CO",
+	"DOSNEC.CO",
+	"SAR100.CO",
+	"SAR200.CO",
+	// The rest of these files don't exist, but we are ready to serve them up if they did exist.
+	// Some are known to have existed, but no known copies available currently.
+	// Some may not have ever existed. Most filenames are guesses.
+	"SARNEC.CO", // Sardine for NEC is known to have existed, with this filename.
+	"DOSM10.CO", // or DOSOLV.CO ? Jeff Birt found TS-DOS for Olivetti M-10 listed in a catalog.
+	"DOSK85.CO", // or DOSKYO.CO ? may have never existed
+	"SARM10.CO", // or SAROLV.CO ? Since TS-DOS for M-10 existed, probably Sardine existed too.
+	"SARK85.CO"  // or SRAKYO.CO ? may have never existed
+};
+
+/*************************************************************/
+
+int debug = 0;
+int start_mode = DEFAULT_OPERATION_MODE;
+bool upcase = DEFAULT_UPCASE;
+bool tildes = DEFAULT_TILDES;
+bool fsync_close = DEFAULT_FSYNC;
+bool disk_fs = DEFAULT_DISK_FS;
+int dir_threads = DEFAULT_DIR_THREADS;
+uint8_t model = DEFAULT_MODEL;
+char disk_img_fname[PATH_MAX+1] = {0x00};
+char disk_ovl_dir[PATH_MAX+1] = {0x00}; // -o, see disk_img.c
+static atomic_uint disk_changes = 0; // counts disk_change()
+char app_lib_dir[PATH_MAX+1] = APP_LIB_DIR;
+char dme_root_label[7] = TSDOS_ROOT_LABEL;
+char dme_parent_label[7] = TSDOS_PARENT_LABEL;
+char dme_dir_label[3] = TSDOS_DIR_LABEL;
+uint8_t cfnl = TPDD_FILENAME_LEN;
+atomic_int quit_sig = 0;  // set by the caller's signal handler, read by every worker
+uint8_t rom[ROM_LEN] = {0x00};       // 4k cpu internal mask rom, shared
+
+// client compatibility settings, see load_profile()
+uint8_t base_len = 0;
+uint8_t ext_len = 0;
+char default_attr = ATTR_RAW;
+bool enable_magic_files = false;
+bool pad_fn = false;
+bool dme_en = false;
+
+///////////////////////////////////////////////////////////////////////////////
+
+/* primitives and utilities */
+
+/*
+ * Logging
+ *
+ * dbg(), dbg_b() and dbg_p() are called from the request handlers while
+ * the client is waiting for the response. After log_start() they don't
+ * write to stderr themselves. They put a record in log_ring, and the log
+ * thread formats it and writes it out. dbg() has to format its text right
+ * away, since the args may be gone later, but dbg_b() and dbg_p() just
+ * copy the bytes, and the hex dump is made by the log thread.
+ *
+ * Any thread can add records. Each slot has a sequence number that says
+ * whether it's free for the record at position p, or holds that record
+ * for the log thread, so adding one takes a compare-and-swap on log_head
+ * and no lock. When the ring is full the record is dropped and counted,
+ * rather than making the client wait.
+ *
+ * When it has caught up, the log thread sleeps on log_cond. It sets
+ * log_idle first and then looks at the ring once more, and log_put()
+ * looks at log_idle after adding a record, so one of them always sees
+ * the other. Only a record that finds the thread asleep takes log_lock
+ * to wake it, the rest don't. log_flush() waits on log_caught_up.
+ */
+#define LOG_RING_LEN 4096             // records, must be a power of 2
+#define LOG_REC_LEN  (TPDD_MSG_MAX+4) // bytes per record, room for any packet
+#define LOG_OUT_LEN  65536            // log thread output buffer
+
+enum { LOG_TEXT, LOG_HEX, LOG_HEX_END, LOG_PKT };
+
+typedef struct {
+	atomic_uint seq;
+	uint8_t type;
+	uint16_t len;
+	uint8_t d[LOG_REC_LEN];
+} LOG_REC;
+
+bool log_async = DEFAULT_LOG_ASYNC;
+static LOG_REC log_ring[LOG_RING_LEN];
+static atomic_uint log_head;       // next slot to fill
+static atomic_uint log_tail;       // everything before this is written out
+static atomic_ulong log_dropped;
+static atomic_bool log_run;
+static atomic_bool log_idle;       // log thread is, or is about to be, asleep
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_caught_up = PTHREAD_COND_INITIALIZER;
+
+static void log_wake(void) {
+	pthread_mutex_lock(&log_lock);
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+}
+
+// add one record, or drop it if the ring is full
+static void log_put(uint8_t type, const void* d, int n) {
+	unsigned p = atomic_load_explicit(&log_head,memory_order_relaxed);
+	LOG_REC* r;
+	int i;
+	for (;;) {
+		r = &log_ring[p&(LOG_RING_LEN-1)];
+		i = (int)(atomic_load_explicit(&r->seq,memory_order_acquire)-p);
+		if (!i) {
+			if (atomic_compare_exchange_weak_explicit(&log_head,&p,p+1,memory_order_relaxed,memory_order_relaxed)) break;
+		} else if (i<0) {
+			atomic_fetch_add_explicit(&log_dropped,1,memory_order_relaxed);
+			return;
+		} else p = atomic_load_explicit(&log_head,memory_order_relaxed);
+	}
+	r->type = type;
+	r->len = n;
+	memcpy(r->d,d,n);
+	atomic_store_explicit(&r->seq,p+1,memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&log_idle,memory_order_relaxed)) log_wake();
+}
+
+// add n bytes as as many records as it takes, the last one of type end
+static void log_put_all(uint8_t type, uint8_t end, const void* d, int n) {
+	const uint8_t* b = d;
+	for (;n>LOG_REC_LEN;b+=LOG_REC_LEN,n-=LOG_REC_LEN) log_put(type,b,LOG_REC_LEN);
+	log_put(end,b,n);
+}
+
+static int log_hex(char* o, const uint8_t* b, int n) {
+	static const char x[] = "0123456789ABCDEF";
+	int i;
+	for (i=0;i<n;i++) {
+		*o++ = x[b[i]>>4];
+		*o++ = x[b[i]&0x0F];
+		*o++ = ' ';
+	}
+	return n*3;
+}
+
+static void* log_main(void* arg) {
+	static char o[LOG_OUT_LEN];
+	unsigned t = atomic_load(&log_tail);
+	unsigned long dropped = 0, d;
+	LOG_REC* r;
+	int n = 0;
+	bool run;
+
+	do {
+		run = atomic_load(&log_run);
+		r = &log_ring[t&(LOG_RING_LEN-1)];
+		if (atomic_load_explicit(&r->seq,memory_order_acquire)==t+1) {
+			// worst case is a packet, 3 times the bytes plus the header
+			if (n>LOG_OUT_LEN-LOG_REC_LEN*3-64) { fwrite(o,1,n,stderr); n = 0; }
+			switch (r->type) {
+				case LOG_TEXT: memcpy(o+n,r->d,r->len); n += r->len; break;
+				case LOG_HEX: n += log_hex(o+n,r->d,r->len); break;
+				case LOG_HEX_END: n += log_hex(o+n,r->d,r->len); o[n++] = '\n'; break;
+				case LOG_PKT:
+					n += sprintf(o+n,"cmd: %1$02X\nlen: %2$02X (%2$u)\nchk: %3$02X\ndat: ",r->d[0],r->d[1],r->d[r->d[1]+2]);
+					n += log_hex(o+n,r->d+2,r->d[1]);
+					o[n++] = '\n';
+					break;
+			}
+			atomic_store_explicit(&r->seq,t+LOG_RING_LEN,memory_order_release);
+			t++;
+			continue;
+		}
+		// caught up
+		if ((d = atomic_load(&log_dropped))!=dropped) {
+			n += sprintf(o+n,"(%lu log records dropped)\n",d-dropped);
+			dropped = d;
+		}
+		if (n) { fwrite(o,1,n,stderr); fflush(stderr); n = 0; }
+		pthread_mutex_lock(&log_lock);
+		atomic_store(&log_tail,t);
+		pthread_cond_broadcast(&log_caught_up);
+		atomic_store(&log_idle,true);
+		if (run && atomic_load(&log_run) && atomic_load(&r->seq)!=t+1)
+			pthread_cond_wait(&log_cond,&log_lock);
+		atomic_store(&log_idle,false);
+		pthread_mutex_unlock(&log_lock);
+	} while (run || t!=atomic_load(&log_head));
+	return arg;
+}
+
+// wait until everything logged so far is written out
+void log_flush(void) {
+	if (!atomic_load(&log_run)) return;
+	unsigned h = atomic_load(&log_head);
+	pthread_mutex_lock(&log_lock);
+	while ((int)(atomic_load(&log_tail)-h)<0) pthread_cond_wait(&log_caught_up,&log_lock);
+	pthread_mutex_unlock(&log_lock);
+}
+
+// write out the rest and go back to writing directly
+void log_stop(void) {
+	if (!atomic_exchange(&log_run,false)) return;
+	log_wake();
+	pthread_join(log_thread,NULL);
+}
+
+// from here on, hand log output to the log thread
+void log_start(void) {
+	sigset_t all, old;
+	if (atomic_load(&log_run)) return;
+	for (unsigned i=0;i<LOG_RING_LEN;i++) atomic_init(&log_ring[i].seq,i);
+	atomic_store(&log_head,0);
+	atomic_store(&log_tail,0);
+	atomic_store(&log_run,true);
+	// signals are for the main thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK,&all,&old);
+	if (pthread_create(&log_thread,NULL,log_main,NULL)) atomic_store(&log_run,false);
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+	if (atomic_load(&log_run)) atexit(log_stop);
+}
+
+// dbg(verbosity_threshold, printf_format, args...)
+// dbg(3,"err %02X",err); // means only show this message if debug>=3
+void dbg( const int v, const char* format, ... ) {
+	if (debug<v) return;
+	va_list args;
+	va_start( args, format );
+	if (atomic_load_explicit(&log_run,memory_order_relaxed)) {
+		char b[1024];
+		char* p = b;
+		va_list a;
+		va_copy(a,args);
+		int n = vsnprintf(b,sizeof(b),format,args);
+		if (n>=(int)sizeof(b) && (p = malloc(n+1))) vsnprintf(p,n+1,format,a);
+		if (!p) n = sizeof(b)-1, p = b;
+		if (n>0) log_put_all(LOG_TEXT,LOG_TEXT,p,n);
+		if (p!=b) free(p);
+		va_end(a);
+	} else {
+		vfprintf( stderr, format, args );
+		fflush(stderr);
+	}
+	va_end( args );
+}
+
+// dbg_b(verbosity_threshold, buffer, len)
+// dbg_b(3, b, 24); // like dbg() except
+// print n bytes of b[] as hex pairs and a trailing newline
+// if n<0, then use TPDD_MSG_MAX
+void dbg_b(const int v, unsigned char* b, int n) {
+	if (debug<v) return;
+	unsigned i;
+	if (n<0) n = TPDD_MSG_MAX;
+	if (atomic_load_explicit(&log_run,memory_order_relaxed)) { log_put_all(LOG_HEX,LOG_HEX_END,b,n); return; }
+	for (i=0;i<n;i++) fprintf (stderr,"%02X ",b[i]);
+	fprintf (stderr, "\n");
+	fflush(stderr);
+}
+
+// like dbg_b, except assume b[] is an Operation-mode req or ret block
+// and parse it to display the parts: cmd, len, payload, checksum.
+void dbg_p(const int v, unsigned char* b) {
+	if (debug<v) return;
+	if (atomic_load_explicit(&log_run,memory_order_relaxed)) { log_put(LOG_PKT,b,b[1]+3); return; }
+	dbg(v,"cmd: %1$02X\nlen: %2$02X (%2$u)\nchk: %3$02X\ndat: ",b[0],b[1],b[b[1]+2]);
+	dbg_b(v,b+2,b[1]);
+}
+
+void update_cwd(SESSION* ses) {
+	// if the current directory is not writable, set the write-protected disk flag
+	uint8_t wp = 0;
+	if (faccessat(ses->dir_fd,".",W_OK|X_OK,0)) wp = 1;
+	ses->pdd1_condition |= wp << PDD1_COND_BIT_WPROT;
+	ses->pdd2_condition |= wp << PDD2_COND_BIT_WPROT;
+}
+
+// Change the session's current directory to d, relative to the current one.
+// Sessions don't chdir(), so that each one can have its own cwd. Instead
+// dir_fd is the current directory, and everything local is opened relative
+// to it. cwd is kept as the path, for display and the directory cache.
+int session_cd(SESSION* ses, const char* d) {
+	int h = openat(ses->dir_fd,d,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (h<0) return -1;
+	if (ses->dir_fd>=0) close(ses->dir_fd);
+	ses->dir_fd = h;
+
+	char* p;
+	size_t l = strlen(ses->cwd);
+	if (d[0]=='/') {
+		strncpy(ses->cwd,d,PATH_MAX);
+	} else if (!strcmp(d,"..")) {
+		if ((p = strrchr(ses->cwd,'/'))) p[p==ses->cwd] = 0x00;
+	} else if (l+1+strlen(d)<=PATH_MAX) {
+		if (l && ses->cwd[l-1]!='/') ses->cwd[l++] = '/';
+		strcpy(ses->cwd+l,d);
+	}
+	update_cwd(ses);
+	return 0;
+}
+
+void cd_share_path(SESSION* ses) {
+	if (!ses->share_path[ses->bank][0]) return;
+	if (!strncmp(ses->cwd,ses->share_path[ses->bank],PATH_MAX)) return;
+	if (session_cd(ses,ses->share_path[ses->bank])) dbg(0,"FAILED CD TO \"%s\"\n",ses->share_path[ses->bank]);
+}
+
+int write_client_tty(SESSION* ses, void* b, int n) {
+	dbg(4,"%s(%u)\n",__func__,n);
+	n = write(ses->tty_fd,b,n);
+	if (n>0) ses->st_out += n;
+	if (n>0) capture_put(ses,CAP_SENT,b,n);
+	dbg(3,"SENT: "); dbg_b(3,b,n);
+	return n;
+}
+
+/*
+ * Write-behind buffer
+ *
+ * req_write() used to write() every packet of up to 128 bytes as it came
+ * in. Now packets are collected in wb_buf[] and written out in one go
+ * when it fills up, when the file is closed, and when the client goes
+ * quiet for WRITE_BEHIND_MS (see rx_fill()), so a stalled client doesn't
+ * leave data sitting in memory.
+ *
+ * Each packet is still acked right away, so a write error that only
+ * happens at flush time is held in wb_err and reported on the next
+ * status or close, and fails any further writes until then.
+ */
+
+// write out wb_buf[], returns wb_err
+uint8_t wb_flush(SESSION* ses) {
+	int i, t = 0;
+	if (ses->img_bank>=0) {
+		if (ses->wb_len && (i = img_fs_write(ses,ses->wb_buf,ses->wb_len))) ses->wb_err = i;
+		ses->wb_len = 0;
+		return ses->wb_err;
+	}
+	while (t<ses->wb_len) {
+		i = write(ses->o_file_h,ses->wb_buf+t,ses->wb_len-t);
+		if (i<0 && errno==EINTR) continue;
+		if (i<0) {
+			dbg(0,"write: %s\n",strerror(errno));
+			ses->wb_err = ERR_SECTOR_NUM;
+			break;
+		}
+		t += i;
+	}
+	ses->wb_len = 0;
+	return ses->wb_err;
+}
+
+// close o_file_h, flushing buffered writes first,
+// returns any deferred write error
+uint8_t close_o_file(SESSION* ses) {
+	if (ses->img_bank>=0) {
+		if (ses->f_open_mode!=F_OPEN_READ) wb_flush(ses);
+		ses->img_bank = -1;
+		return ses->wb_err;
+	}
+	if (ses->o_file_h<0) return ses->wb_err;
+	if (ses->f_open_mode!=F_OPEN_READ) {
+		wb_flush(ses);
+		if (fsync_close && fsync(ses->o_file_h)) {
+			dbg(0,"fsync: %s\n",strerror(errno));
+			ses->wb_err = ERR_SECTOR_NUM;
+		}
+		dir_cache_invalidate(ses->cwd);
+	}
+	// network filesystems may only report write errors here
+	if (close(ses->o_file_h) && ses->f_open_mode!=F_OPEN_READ) {
+		dbg(0,"close: %s\n",strerror(errno));
+		ses->wb_err = ERR_SECTOR_NUM;
+	}
+	ses->o_file_h = -1;
+	return ses->wb_err;
+}
+
+long now_ms() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000L + t.tv_nsec/1000000L;
+}
+
+long now_us() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000L + t.tv_nsec/1000L;
+}
+
+/*
+ * Sessions
+ *
+ * A SESSION is all the state of one client connection, see tpdd.h.
+ * Nothing here knows how many there are, the caller keeps track of them.
+ */
+
+// new session for tty, serving path (bank 0) and path1 (tpdd2 bank 1)
+// The caller opens tty_fd.
+SESSION* session_new(const char* tty, const char* path, const char* path1) {
+	SESSION* s = calloc(1,sizeof(SESSION));
+	if (!s) return NULL;
+
+	strncpy(s->tty_name,tty,PATH_MAX);
+	s->tty_fd = -1;
+	strncpy(s->share_path[0],path,PATH_MAX);
+	strncpy(s->share_path[1],path1,PATH_MAX);
+	s->operation_mode = start_mode;
+	s->o_file_h = -1;
+	s->img_bank = -1;
+	s->cap_fd = -1;
+	s->f_open_mode = F_OPEN_NONE;
+	s->wb_err = ERR_SUCCESS;
+	s->pdd1_condition = PDD1_COND_NONE;
+	s->pdd2_condition = PDD2_COND_NONE;
+	s->disk_seen = atomic_load(&disk_changes);
+	s->dirent_free = model==2?(PDD2_TRACKS*PDD2_SECTORS):(PDD1_TRACKS*PDD1_SECTORS);
+	memcpy(s->dme_cwd,TSDOS_ROOT_LABEL,7);
+	if (dme_en && base_len && base_len<=6) memcpy(s->dme_cwd,dme_root_label,base_len);
+
+	// start out in the process cwd, until cd_share_path()
+	s->dir_fd = open(".",O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (s->dir_fd<0 || !getcwd(s->cwd,PATH_MAX) || file_list_init(&s->files)) {
+		session_free(s);
+		return NULL;
+	}
+	update_cwd(s);
+	return s;
+}
+
+// flush & close the open file, and free the session
+// The caller closes tty_fd.
+void session_free(SESSION* ses) {
+	close_o_file(ses);
+	capture_close(ses);
+	if (ses->dir_fd>=0) close(ses->dir_fd);
+	file_list_cleanup(&ses->files);
+	free(ses->dirent_frames);
+	disk_img_ovl_close(ses->disk_ovl);
+	free(ses);
+}
+
+// Give up on the request in progress, back to serve_session() or serve_client().
+void session_abort(SESSION* ses, int r) {
+	ses->rx_head = ses->rx_tail;
+	longjmp(ses->jmp,r);
+}
+
+/*
+ * Receive buffer
+ *
+ * Everything from the client goes through rx_buf[]. rx_fill() takes
+ * everything the tty has ready in a single read, and the command parsers
+ * then pick whole frames and parameters out of memory instead of making
+ * a read() syscall for every byte.
+ */
+
+#define RX_MASK (RX_BUF_LEN-1)
+#define rx_avail() (ses->rx_tail-ses->rx_head)
+#define rx_peek(i) ses->rx_buf[(ses->rx_head+(i))&RX_MASK]
+#define rx_getc() ses->rx_buf[ses->rx_head++&RX_MASK]
+
+// wait up to ms for input, ms<0 = forever
+// returns >0 if there is input, 0 if timed out, <0 if interrupted
+int rx_wait(SESSION* ses, int ms) {
+	struct pollfd p = { .fd = ses->tty_fd, .events = POLLIN };
+	return poll(&p,1,ms);
+}
+
+// one read of whatever is available, into both halves of the free space
+// blocks according to the current VMIN & VTIME
+int rx_fill(SESSION* ses) {
+	unsigned t = ses->rx_tail&RX_MASK;
+	unsigned f = RX_BUF_LEN-rx_avail();
+	struct iovec v[2];
+	int i = 1, n = 1;
+	if (!f) return 0;
+	if (quit_sig) session_abort(ses,SES_QUIT);
+
+	// if the client is quiet for a while, flush buffered file writes
+	if (ses->wb_len && !(i = rx_wait(ses,WRITE_BEHIND_MS))) wb_flush(ses);
+
+	// when serving several clients, one that stops in the middle of a
+	// request must not hold up the others
+	if (i>0 && ses->stall_ms && !(i = rx_wait(ses,ses->stall_ms))) {
+		dbg(1,"%s: timed out\n",ses->tty_name);
+		session_abort(ses,SES_DROP_CMD);
+	}
+	if (i<0) return 0; // EINTR, check quit_sig next time around
+
+	v[0].iov_base = ses->rx_buf+t;
+	v[0].iov_len = RX_BUF_LEN-t;
+	if (v[0].iov_len>=f) v[0].iov_len = f;
+	else { v[1].iov_base = ses->rx_buf; v[1].iov_len = f-v[0].iov_len; n = 2; }
+	i = readv(ses->tty_fd,v,n);
+	if (i<0 && errno==EINTR) return 0; // check quit_sig next time around
+	if (i<0 || (!i && ses->stall_ms)) {
+		dbg(0,"%s: %s\n",ses->tty_name,i?strerror(errno):"hangup");
+		session_abort(ses,SES_CLOSE);
+	}
+	capture_put(ses,0,ses->rx_buf+t,MIN(i,RX_BUF_LEN-t));
+	if (i>RX_BUF_LEN-t) capture_put(ses,0,ses->rx_buf,i-(RX_BUF_LEN-t));
+	ses->rx_tail += i;
+	ses->rx_ms = now_ms();
+	return i;
+}
+
+// wait until at least n bytes are buffered, n <= RX_BUF_LEN
+void rx_need(SESSION* ses, const unsigned n) {
+	while (rx_avail()<n) rx_fill(ses);
+}
+
+// move n buffered bytes to b[]
+void rx_take(SESSION* ses, uint8_t* b, unsigned n) {
+	unsigned h = ses->rx_head&RX_MASK;
+	unsigned l = RX_BUF_LEN-h;
+	if (l>n) l = n;
+	memcpy(b,ses->rx_buf+h,l);
+	memcpy(b+l,ses->rx_buf,n-l);
+	ses->rx_head += n;
+}
+
+// It is correct that this blocks and waits forever.
+// The one time we don't want to block, we don't use this.
+int read_client_tty(SESSION* ses, void* b, const unsigned int n) {
+	dbg(4,"%s(%u)\n",__func__,n);
+	unsigned t = 0;
+	unsigned i;
+	while (t<n) {
+		if (!rx_avail()) rx_fill(ses);
+		i = rx_avail(); if (i>n-t) i = n-t;
+		rx_take(ses,(uint8_t*)b+t,i);
+		t += i;
+	}
+	dbg(3,"RCVD: "); dbg_b(3,b,n);
+	return t;
+}
+
+/*
+ * The manual says:
+ *
+ * "The checksum is the one's complement of the least significant byte
+ *  of the number of bytes from the block format through the data block."
+ *
+ * But the bytes are summed, not just counted!
+ * Replace "number of" with "sum of the".
+ *
+ * Sum all the bytes in the specified range.
+ * Take the least significant byte of that sum.
+ * Invert all the bits in that byte.
+ *
+ * b[0] = cmd  (block format)
+ * b[1] = len
+ * b[2] to b[1+len] = 0 to 128 bytes of payload  (data block)
+ * ignore everything after b[1+len]
+ */
+uint8_t checksum(unsigned char* b) {
+	uint16_t s=0, i, l=2+b[1];
+	for (i=0;i<l;i++) s+=b[i];
+	return ~(s&0xFF);
+}
+
+char* collapse_padded_fname(char* fname) {
+	dbg(3,"%s(\"%s\")\n",__func__,fname);
+	if (!pad_fn) return fname;
+	if (!base_len) return fname;
+
+	int i;
+	for (i=base_len;i>1;i--) if (fname[i-1]!=' ') break;
+
+	if (fname[base_len+1]==dme_dir_label[0] && fname[base_len+2]==dme_dir_label[1]) {
+		fname[i]=0x00;
+	} else {
+		fname[i]=fname[base_len];
+		fname[i+1]=fname[base_len+1];
+		fname[i+2]=fname[base_len+2];
+		fname[i+3]=0x00;
+	}
+	return fname;
+}
+
+int check_magic_file(char* b) {
+	dbg(3,"%s(\"%s\")\n",__func__,b);
+	if (!enable_magic_files) return 1;
+	int l = sizeof(magic_files)/sizeof(magic_files[0]);
+	for (int i=0;i<l;++i) if (!strcmp(magic_files[i],b)) return 0;
+	return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//  FDC MODE
+//
+
+/*
+ * sectors: 0-79
+ * sector: 1293 bytes
+ * | LSC 1 byte | ID 12 bytes | DATA 1280 bytes |
+ * LSC: logical sector size code
+ * ID: 12 bytes of arbitrary data, searchable by req_fdc_search_id()
+ * DATA: 1280 bytes of arbitrary data, read/writable in lsc_to_len(LSC)-sized chunks
+ */
+
+// standard fdc-mode 8-byte response
+// e = error code ERR_FDC_* -> ascii hex pair
+// s = status or data       -> ascii hex pair
+// l = length or address    -> 2 ascii hex pairs
+// TODO - don't assume endianness
+void ret_fdc_std(SESSION* ses, uint8_t e, uint8_t s, uint16_t l) {
+	dbg(2,"%s()\n",__func__);
+	char b[9] = { 0x00 };
+	snprintf(b,9,"%02X%02X%04X",e,s,l);
+	ses->st_err = e;
+	dbg(2,"FDC: response: \"%s\"\n",b);
+	write_client_tty(ses,b,8);
+}
+
+// Swap the disk for image f from the -L library, for every session, in
+// place of restarting with a new -i. Only the image is changed, the ttys
+// are left alone. Each session finds out the next time it asks about the
+// disk, see disk_check(). -1 with errno set if f isn't in the library or
+// is the wrong size for the model, and then the old disk stays in.
+// The copy in the library is used even if the file was deleted since.
+int disk_change(const char* f, int sync) {
+	STORE_IMG* s = img_store_find(f);
+	int r, e;
+	if (!s) { errno = ENOENT; return -1; }
+	if (img_store_len(s)!=(model==2?PDD2_IMG_LEN:PDD1_IMG_LEN)) { errno = EINVAL; return -1; }
+	disk_img_lock(NULL);
+	bool v = disk_img_is_virtual();
+	if ((r = disk_img_open_store(s,sync))) {
+		e = errno;
+		if (v) img_dir_open(disk_img_fname);
+		else if (*disk_img_fname) disk_img_open(disk_img_fname,img_store_len(s),sync);
+		errno = e;
+	} else {
+		strncpy(disk_img_fname,img_store_path(s),PATH_MAX);
+		atomic_fetch_add(&disk_changes,1);
+	}
+	disk_img_unlock();
+	return r;
+}
+
+// Copy disk_img_fname to b, PATH_MAX+1 long. disk_change() may be
+// writing it from the changer thread, so don't read it without the lock.
+void disk_name(char* b) {
+	disk_img_lock(NULL);
+	strcpy(b,disk_img_fname);
+	disk_img_unlock();
+}
+
+// If the disk was changed since this session last looked, set the disk
+// changed condition like a real drive, and let go of everything that was
+// about the old disk: a file open in it, and the overlay of it.
+static void disk_check(SESSION* ses) {
+	unsigned c = atomic_load(&disk_changes);
+	if (ses->disk_seen==c) return;
+	ses->disk_seen = c;
+	dbg(1,"Disk changed\n");
+	ses->pdd1_condition |= 1 << PDD1_COND_BIT_CHANGED;
+	ses->pdd2_condition |= 1 << PDD2_COND_BIT_CHANGED;
+	if (ses->img_bank>=0) {
+		ses->img_bank = -1;
+		ses->wb_len = 0;
+		ses->f_open_mode = F_OPEN_NONE;
+	}
+	disk_img_ovl_close(ses->disk_ovl);
+	ses->disk_ovl = NULL;
+}
+
+// With -o, the session's writes to the disk image go to its own delta file
+// in disk_ovl_dir, named for the image and the tty, instead of the image.
+static void open_disk_ovl(SESSION* ses) {
+	char f[3*(PATH_MAX+1)+8];
+	char n[PATH_MAX+1];
+	disk_name(n);
+	if (!*n) return;
+	const char* i = strrchr(n,'/');
+	const char* t = strrchr(ses->tty_name,'/');
+	snprintf(f,sizeof(f),"%s/%s.%s.ovl",disk_ovl_dir,i?i+1:n,t?t+1:ses->tty_name);
+	if ((ses->disk_ovl = disk_img_ovl_open(f))) dbg(1,"Disk image changes in \"%s\"\n",f);
+	else if (disk_img_len()) dbg(0,"%s: %s\n",f,strerror(errno));
+}
+
+// p   : physical sector, disk_rec is set to point at it
+// m   : mode read-only / write-only / read-write
+// On success the image stays locked until close_disk_image(), so don't
+// talk to the client in between. The client may stall, and the other
+// sessions would have to wait for it.
+int open_disk_image(SESSION* ses, int p, int m) {
+	dbg(2,"%s(%d,%d)\n",__func__,p,m);
+	int e=ERR_FDC_SUCCESS;
+	ses->disk_rec = NULL;
+	// disk_change() may swap the disk before the lock is taken,
+	// then let go of the old disk's things and look again
+	for (;;) {
+		disk_check(ses);
+		if (*disk_ovl_dir && !ses->disk_ovl) open_disk_ovl(ses);
+		disk_img_lock(ses->disk_ovl);
+		if (ses->disk_seen==atomic_load(&disk_changes)) break;
+		disk_img_unlock();
+	}
+
+	if (!*disk_img_fname) e=ERR_FDC_NO_DISK;
+	else if (disk_img_check()) { dbg(0,"%s: %s\n",disk_img_fname,strerror(errno)); e=ERR_FDC_READ; }
+	else if (*disk_ovl_dir && !ses->disk_ovl && m!=O_RDONLY) e=ERR_FDC_WRITE_PROTECT; // never the base image
+
+	if (!e) switch (m) {
+		case O_RDWR: dbg(2,"edit rw\n");
+			if (!disk_img_len() || disk_img_wp()) e=ERR_FDC_WRITE_PROTECT;
+			break;
+		case O_WRONLY:
+			if (disk_img_wp()) { e=ERR_FDC_WRITE_PROTECT; break; }
+			dbg(2,disk_img_len()?"edit wo\n":"create\n");
+			if (disk_img_create(model==2?PDD2_IMG_LEN:PDD1_IMG_LEN)) { dbg(0,"%s\n",strerror(errno)); e=ERR_FDC_READ; }
+			break;
+		default: dbg(2,"read\n"); break;
+	}
+
+	if (!e) {
+		ses->disk_rec = m==O_RDONLY ? disk_img_rec(p) : disk_img_rec_w(p);
+		if (!ses->disk_rec) e=ERR_FDC_READ;
+	}
+	if (e) disk_img_unlock();
+	else ses->st_disk_t = now_us();
+
+	if (ses->operation_mode) switch (e) {
+		//case ERR_FDC_SUCCESS: e=ERR_SUCCESS; break; // same
+		case ERR_FDC_NO_DISK: e=ERR_NO_DISK; break;
+		case ERR_FDC_WRITE_PROTECT: e=ERR_WRITE_PROTECT; break;
+		case ERR_FDC_READ: e=ERR_READ_TIMEOUT; break;
+	}
+
+	return e;
+}
+
+void close_disk_image(SESSION* ses) {
+	ses->disk_rec = NULL;
+	disk_img_unlock();
+	stats_time(&stat_disk,now_us()-ses->st_disk_t);
+}
+
+void req_fdc_set_mode(SESSION* ses, int m) {
+	dbg(2,"%s(%d)\n",__func__,m);
+	ses->operation_mode = m; // no response, just switch modes
+	if (m==MODE_OPR) dbg(2,"Switched to \"Operation\" mode\n");
+}
+
+// disk state
+// ret_fdc_std(e,s,l)
+// e = ERR_FDC_SUCCESS
+// s =
+//   bit 7 = disk not inserted
+//   bit 6 = disk changed
+//   bit 5 = disk write-protected
+//   0-4 not used
+// l = 0
+void req_fdc_condition(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	disk_check(ses);
+	ret_fdc_std(ses,ERR_FDC_SUCCESS,ses->pdd1_condition,0);
+	ses->pdd1_condition &= ~(1 << PDD1_COND_BIT_CHANGED); // reported once
+}
+
+// lc = logical sector size code
+void req_fdc_format(SESSION* ses, uint8_t lc) {
+	dbg(2,"%s(%d)\n",__func__,lc);
+	uint16_t ll = FDC_LOGICAL_SECTOR_SIZE[lc];
+	uint8_t rn = 0;     // physical sector number
+	uint8_t rc = (PDD1_TRACKS*PDD1_SECTORS); // total record count
+
+	dbg(0,"Format: Logical sector size: %d = %d\n",lc,ll);
+
+	uint8_t e = open_disk_image(ses,0,O_RDWR);
+	if (e) { ret_fdc_std(ses,e,0,0); return; }
+
+	for (rn=0;rn<rc;rn++) {
+		if (!(ses->disk_rec = disk_img_rec_w(rn))) {
+			dbg(0,"format: record %d not in image\n",rn);
+			e = ERR_FDC_READ;
+			break;
+		}
+		memset(ses->disk_rec,0x00,SECTOR_LEN);
+		ses->disk_rec[0]=lc; // logical sector size code
+	}
+
+	disk_img_commit(-1);
+	close_disk_image(ses);
+	if (!e) rn = 0;
+	ret_fdc_std(ses,e,rn,0);
+}
+
+// read ID section of a sector
+// p = physical sector number 0-79
+void req_fdc_read_id(SESSION* ses, uint8_t p) {
+	dbg(2,"%s(%d)\n",__func__,p);
+
+	uint8_t e = open_disk_image(ses,p,O_RDONLY);
+	if (e) { ret_fdc_std(ses,e,0,0); return; }
+
+	memcpy(ses->rb,ses->disk_rec,SECTOR_HEADER_LEN);
+	close_disk_image(ses);
+	dbg_b(2,ses->rb,SECTOR_HEADER_LEN);
+
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[ses->rb[0]];          // get logical size from header
+	ret_fdc_std(ses,ERR_FDC_SUCCESS,p,l);   // send OK
+	char t=0x00;
+	read_client_tty(ses,&t,1); // read 1 byte from client
+	if (t==FDC_CMD_EOL) write_client_tty(ses,ses->rb+1,SECTOR_ID_LEN); // if 0D send data else silently abort
+}
+
+// read DATA section of a sector
+// tp = target physical sector 0-79
+// tl = target logical sector 1-20
+void req_fdc_read_sector(SESSION* ses, uint8_t tp,uint8_t tl) {
+	dbg(2,"%s(%d,%d)\n",__func__,tp,tl);
+
+	uint8_t e = open_disk_image(ses,tp,O_RDONLY);
+	if (e) { ret_fdc_std(ses,e,0,0); return; }
+
+	dbg_b(3,ses->disk_rec,SECTOR_HEADER_LEN);
+
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[ses->disk_rec[0]]; // get logical size from header
+	if (l*tl>SECTOR_DATA_LEN) {
+		close_disk_image(ses);
+		ret_fdc_std(ses,ERR_FDC_LSN_HI,tp,l);
+		return;
+	}
+
+	// one logical sector of DATA at header + (target_logical-1)*logical_size
+	memcpy(ses->rb,ses->disk_rec+SECTOR_HEADER_LEN+((tl-1)*l),l);
+	close_disk_image(ses);
+	ret_fdc_std(ses,ERR_FDC_SUCCESS,tp,l); // 1st stage response
+	char t=0x00;
+	read_client_tty(ses,&t,1); // read 1 byte from client
+	if (t==FDC_CMD_EOL) write_client_tty(ses,ses->rb,l); // if 0D send data else silently abort
+}
+
+// ref/search_id_section.txt
+// Answered from the ID index in disk_img.c instead of reading every record.
+void req_fdc_search_id(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	int rn = 0;     // physical sector number
+	int rc = (PDD1_TRACKS*PDD1_SECTORS); // total record count
+	char sb[SECTOR_ID_LEN] = {0x00}; // search data
+
+	uint8_t e = open_disk_image(ses,0,O_RDONLY);
+	if (e) { ret_fdc_std(ses,e,0,0); return; }
+	close_disk_image(ses);
+
+	ret_fdc_std(ses,ERR_FDC_SUCCESS,0,0); // tell client to send data
+	read_client_tty(ses,sb,SECTOR_ID_LEN); // read 12 bytes from client
+	dbg_b(3,(uint8_t*)sb,SECTOR_ID_LEN);
+
+	// does sb exactly match an ID?
+	// a real search ends on the last record, and reports its logical size
+	uint16_t l = 0;
+	disk_img_lock(ses->disk_ovl);
+	disk_img_check(); // no records if the file shrank
+	ses->st_disk_t = now_us();
+	if ((rn = disk_img_find_id((uint8_t*)sb,rc)) < 0) {
+		e = ERR_FDC_ID_NOT_FOUND;
+		if ((ses->disk_rec = disk_img_rec(rc-1))) rn = 255;
+		else { e = ERR_FDC_READ; rn = disk_img_len()/SECTOR_LEN; }
+	} else ses->disk_rec = disk_img_rec(rn);
+	if (ses->disk_rec) l = FDC_LOGICAL_SECTOR_SIZE[ses->disk_rec[0]];
+	close_disk_image(ses);
+
+	if (e==ERR_FDC_READ) dbg(0,"search: record %d not in image\n",rn);
+	ret_fdc_std(ses,e,rn,l);
+}
+
+// The write commands look at the record before the client sends the data.
+// Only read it then, and don't copy it for writing until the data is here,
+// but still report a write-protected disk right away.
+static uint8_t open_disk_probe(SESSION* ses, int p) {
+	uint8_t e = open_disk_image(ses,p,O_RDONLY);
+	if (!e && (disk_img_wp() || (*disk_ovl_dir && !ses->disk_ovl))) {
+		close_disk_image(ses);
+		e = ERR_FDC_WRITE_PROTECT;
+	}
+	if (e==ERR_FDC_READ) { // O_RDWR calls no image at all write-protected
+		disk_img_lock(NULL);
+		if (!disk_img_len()) e = ERR_FDC_WRITE_PROTECT;
+		disk_img_unlock();
+	}
+	return e;
+}
+
+void req_fdc_write_id(SESSION* ses, int tp) {
+	dbg(2,"%s(%d)\n",__func__,tp);
+
+	uint8_t e = open_disk_probe(ses,tp);
+	if (e) { ret_fdc_std(ses,e,0,0); return; }
+
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[ses->disk_rec[0]]; // get logical size from LSC
+	close_disk_image(ses);
+
+	ret_fdc_std(ses,ERR_FDC_SUCCESS,tp,l); // tell client to send data
+
+	read_client_tty(ses,ses->rb,SECTOR_ID_LEN); // read 12 bytes from client
+
+	// write those to the image
+	if ((e = open_disk_image(ses,tp,O_RDWR))) { ret_fdc_std(ses,e,tp,l); return; }
+	memcpy(ses->disk_rec+1,ses->rb,SECTOR_ID_LEN);
+	disk_img_commit(tp);
+	close_disk_image(ses);
+
+	ret_fdc_std(ses,e,tp,l); // send final response to client
+}
+
+void req_fdc_write_sector(SESSION* ses, int tp,int tl) {
+	dbg(2,"%s(%d,%d)\n",__func__,tp,tl);
+
+	uint8_t e = open_disk_probe(ses,tp);
+	if (e) { ret_fdc_std(ses,e,0,0); return; }
+
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[ses->disk_rec[0]]; // get logical size from header
+	close_disk_image(ses);
+
+	if (l*tl>SECTOR_DATA_LEN) {
+		ret_fdc_std(ses,ERR_FDC_LSN_HI,tp,l);
+		return;
+	}
+
+	ret_fdc_std(ses,ERR_FDC_SUCCESS,tp,l); // tell client to send data
+
+	read_client_tty(ses,ses->rb,l); // read logical_size bytes from client
+
+	// write them to the image at header + (target_logical-1)*logical_size
+	// the sector size could have changed meanwhile, by another session
+	if ((e = open_disk_image(ses,tp,O_RDWR))) { ret_fdc_std(ses,e,tp,l); return; }
+	if (FDC_LOGICAL_SECTOR_SIZE[ses->disk_rec[0]]==l) {
+		memcpy(ses->disk_rec+SECTOR_HEADER_LEN+((tl-1)*l),ses->rb,l);
+		disk_img_commit(tp);
+	} else e = ERR_FDC_LSN_HI;
+	close_disk_image(ses);
+	if (e) { ret_fdc_std(ses,e,tp,l); return; }
+
+	ret_fdc_std(ses,ERR_FDC_SUCCESS,tp,l); // send final OK to client
+}
+
+// Is a whole FDC command buffered, so that get_fdc_cmd() won't block?
+// Eats 0x00 before the command byte the same way get_fdc_cmd() would.
+bool fdc_cmd_ready(SESSION* ses) {
+	unsigned i = 1, n = 0;
+	uint8_t c;
+	while (rx_avail() && !rx_peek(0)) ses->rx_head++;
+	if (!rx_avail()) return false;
+	if (rx_peek(0)==FDC_CMD_EOL) return true;
+	while (n<6) {  // max params is "##,##"
+		if (i>=rx_avail()) return false;
+		c = rx_peek(i++);
+		if (c==FDC_CMD_EOL) return true;
+		if (c!=0x20) n++;
+	}
+	return true;
+}
+
+// ref/fdc.txt
+void get_fdc_cmd(SESSION* ses) {
+	dbg(3,"%s()\n",__func__);
+	uint8_t i = 0;
+	bool eol = false;
+	uint8_t c = 0x00;
+	int p = -1;
+	int l = -1;
+	unsigned h = ses->rx_head;
+	long t0;
+
+	memset(ses->gb,0x00,TPDD_MSG_MAX);
+
+	// scan for a valid command byte first
+	while (!c) {
+		rx_need(ses,1);
+		c = rx_getc();
+		if (c==FDC_CMD_EOL) { eol=true; c=0x20; break; } // fall through to ERR_FDC_COMMAND, important for Sardine
+		if (!strchr(FDC_CMDS,c)) c=0x20 ; // eat bytes until valid cmd or eol
+	}
+
+	// read params
+	i = 0;
+	while (i<6 && !eol) {  // max params is "##,##"
+		rx_need(ses,1);
+		ses->gb[i] = rx_getc();
+		switch (ses->gb[i]) {
+			case FDC_CMD_EOL: eol=true;    // fall through
+			case 0x20: ses->gb[i]=0x00; break;  // if 1st byte after cmd is space, ignore it
+			default: i++;
+		}
+	}
+	dbg(3,"RCVD: %c%s\n",c,ses->gb);
+	t0 = now_us();
+	ses->st_out = 0;
+	ses->st_err = 0;
+
+	// We can pre-parse & validate the params since they take the same
+	// form (or a consistent subset) for all commands.
+	// Parameters, if they exist, are always one of:
+	//   P,L
+	//   P
+	//   <none>
+	// where:
+	// P = physical sector number 0-79 (decimal integer as 0-2 ascii characters)
+	// L = logical sector number 1-20 (decimal integer as 0-2 ascii characters)
+	// (P & L sometimes have other meanings but the format & type rule still holds)
+	p=0; // real drive uses physical sector 0 when omitted
+	l=1; // real drive uses logical sector 1 when omitted
+	char* t;
+	char* sp;
+	if ((t=strtok_r((char*)ses->gb,",",&sp))!=NULL) p=atoi(t); // target physical sector number
+	if ((t=strtok_r(NULL,",",&sp))!=NULL) l=atoi(t); // target logical sector number
+	// for physical sector out of range, real drive error response will have dat=last_valid_p if any
+	// if no command has ever supplied a valid physical sector number yet, then dat=FF
+	if (p<0) ret_fdc_std(ses,ERR_FDC_PARAM,0xFF,0);
+	else if (p>79) ret_fdc_std(ses,ERR_FDC_PSN_HI,0xFF,0);
+	else if (l<1) ret_fdc_std(ses,ERR_FDC_LSN_LO,p,0);
+	else if (l>20) ret_fdc_std(ses,ERR_FDC_LSN_HI,p,0);
+	else {
+		// debug
+		dbg(3,"command:%c  physical:%d  logical:%d\n",c,p,l);
+
+		// dispatch
+		switch (c) {
+			case FDC_SET_MODE:        req_fdc_set_mode(ses,p);        break;
+			case FDC_CONDITION:       req_fdc_condition(ses);         break;
+			case FDC_FORMAT_NV:
+			case FDC_FORMAT:          req_fdc_format(ses,p);          break;
+			case FDC_READ_ID:         req_fdc_read_id(ses,p);         break;
+			case FDC_READ_SECTOR:     req_fdc_read_sector(ses,p,l);   break;
+			case FDC_SEARCH_ID:       req_fdc_search_id(ses);         break;
+			case FDC_WRITE_ID_NV:
+			case FDC_WRITE_ID:        req_fdc_write_id(ses,p);        break;
+			case FDC_WRITE_SECTOR_NV:
+			case FDC_WRITE_SECTOR:    req_fdc_write_sector(ses,p,l);  break;
+			default: dbg(2,"FDC: invalid cmd \"%s\"\n",ses->gb);
+				ret_fdc_std(ses,ERR_FDC_COMMAND,0,0); // required for model detection
+		}
+	}
+	stats_req(stats_fdc_op(c),t0,ses->rx_head-h,ses->st_out,ses->st_err);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//  OPERATION MODE
+//
+
+/*
+ * Client filename cache
+ *
+ * Every listing runs every local filename through the client profile
+ * rules again, even though the same names come up every time. So the
+ * translated names are kept in a direct-mapped table, keyed on the local
+ * name and the flags, and make_file_entry() only translates a name the
+ * first time it sees it, or when another name took its slot.
+ *
+ * The result also depends on the profile settings. Those are copied into
+ * fn_key, and if they no longer match, eg after load_profile(), the whole
+ * table is dropped. The table is shared by all sessions, under fn_lock.
+ */
+
+#define FN_CACHE_SLOTS 1024 // power of 2
+
+typedef struct {
+	uint8_t base_len, ext_len, cfnl;
+	bool pad_fn, upcase, tildes, dme_en;
+	char parent[7];
+	char dir[3];
+} FN_KEY;
+
+typedef struct {
+	uint32_t hash;      // 0 = empty
+	char flags;
+	char local_fname[LOCAL_FILENAME_MAX+1];
+	char client_fname[TPDD_FILENAME_LEN+1];
+} FN_SLOT;
+
+static FN_SLOT fn_cache[FN_CACHE_SLOTS];
+static FN_KEY fn_key;
+static pthread_mutex_t fn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t fn_hash(const char* n, char flags) {
+	uint32_t h = fnv1a_add(fnv1a(&flags,1),n,strlen(n));
+	return h ? h : 1;
+}
+
+// the current profile settings, that translate_fname() depends on
+static void fn_key_get(FN_KEY* k) {
+	memset(k,0x00,sizeof(FN_KEY));
+	k->base_len = base_len;
+	k->ext_len = ext_len;
+	k->cfnl = cfnl;
+	k->pad_fn = pad_fn;
+	k->upcase = upcase;
+	k->tildes = tildes;
+	k->dme_en = dme_en;
+	memcpy(k->parent,dme_parent_label,sizeof(k->parent));
+	memcpy(k->dir,dme_dir_label,sizeof(k->dir));
+}
+
+// the client filename of local filename namep, in f->client_fname
+static void translate_fname(FILE_ENTRY* f, char* namep, char flags) {
+	// input length
+	uint8_t il = strlen(namep);
+
+	// find the last dot but not if it's a directory
+	uint8_t dp = 0;
+	if (!flags&FE_FLAGS_DIR && strrchr(namep,'.')) dp = strrchr(namep,'.')-namep;
+
+	// output length
+	uint8_t ol = base_len?(base_len+(ext_len?(1+ext_len):0)):TPDD_FILENAME_LEN;
+
+	if (!ext_len) {
+		// ignore dots
+
+		snprintf(f->client_fname,TPDD_FILENAME_LEN+1,"%-*.*s",ol,ol,namep);
+		if (tildes && il>ol) f->client_fname[ol-1]='~';
+
+	} else {
+		// handle dots
+
+		// base
+		char bn[TPDD_FILENAME_LEN+1] = {0};
+		// might be shorter than base_len
+		uint8_t bl = (dp&&dp<base_len)?dp:base_len;
+		// copy the basename portion of namep
+		if (bl) strncpy(bn,namep,bl);
+		// replace any . with _
+		for (int i=0;i<bl;i++) if (bn[i]=='.') bn[i]='_';
+		// tilde
+		if ( tildes &&
+				dp?dp>bl:il>ol ||
+				(flags&FE_FLAGS_DIR && il > ol-ext_len-1)
+			) bn[bl-1]='~';
+
+		// ext
+		char en[TPDD_FILENAME_LEN+1] = {0};
+		uint8_t x = il-dp-1;
+		uint8_t el = dp? x<ext_len?x:ext_len :0;
+		if (el) strncpy(en,namep+dp+1,el);
+		if (tildes && el && x>el) en[el-1]='~';
+
+		// TS-DOS directories
+		if (dme_en && flags&FE_FLAGS_DIR) {
+			if (!strcmp(namep,"..")) memcpy(bn,dme_parent_label,base_len);
+			memcpy(en,dme_dir_label,ext_len+1);
+			el = ext_len;
+		}
+
+		// output
+		// base
+		if (pad_fn) snprintf(f->client_fname,cfnl,"%-*.*s",base_len,base_len,bn);
+		else        snprintf(f->client_fname,cfnl,"%s",bn);
+		// dot
+		if (dp||pad_fn) strncat(f->client_fname,".",1);
+		// ext
+		strncat(f->client_fname,en,el);
+
+		// upcase
+		if (upcase) for(int i=0;i<TPDD_FILENAME_LEN;i++) f->client_fname[i]=toupper(f->client_fname[i]);
+	}
+}
+
+// fills in and returns *f
+FILE_ENTRY* make_file_entry(FILE_ENTRY* f, char* namep, uint8_t attr, uint16_t len, char flags) {
+	dbg(3,"%s(\"%s\")\n",__func__,namep);
+	strncpy(f->local_fname, namep, LOCAL_FILENAME_MAX);
+	memset(f->client_fname, 0x00, TPDD_FILENAME_LEN+1);
+	f->attr = attr;
+	f->len = len;
+	f->flags = flags;
+	if (ext_len && dme_en && flags&FE_FLAGS_DIR) f->len = 0;
+
+	FN_KEY k;
+	FN_SLOT* c = NULL;
+	uint32_t h = 0;
+	bool hit = false;
+	if (strlen(namep)<=LOCAL_FILENAME_MAX) {
+		h = fn_hash(namep,flags);
+		c = &fn_cache[h&(FN_CACHE_SLOTS-1)];
+		fn_key_get(&k);
+		pthread_mutex_lock(&fn_lock);
+		if (memcmp(&k,&fn_key,sizeof(FN_KEY))) {
+			memset(fn_cache,0x00,sizeof(fn_cache));
+			fn_key = k;
+		}
+		if ((hit = c->hash==h && c->flags==flags && !strcmp(c->local_fname,namep)))
+			memcpy(f->client_fname,c->client_fname,TPDD_FILENAME_LEN+1);
+		pthread_mutex_unlock(&fn_lock);
+	}
+
+	if (!hit) translate_fname(f,namep,flags);
+	if (!hit && c) {
+		pthread_mutex_lock(&fn_lock);
+		if (!memcmp(&k,&fn_key,sizeof(FN_KEY))) {
+			c->hash = h;
+			c->flags = flags;
+			strcpy(c->local_fname,namep);
+			memcpy(c->client_fname,f->client_fname,TPDD_FILENAME_LEN+1);
+		}
+		pthread_mutex_unlock(&fn_lock);
+	}
+
+	/* match format with header in update_file_list() */
+	dbg(1,"\"%-*s\"  |%c|  %s%s\n",cfnl,f->client_fname,f->attr,f->local_fname,f->flags&FE_FLAGS_DIR?"/":"");
+	return f;
+}
+
+// standard return - return for: error open close delete status write
+void ret_std(SESSION* ses, unsigned char err) {
+	dbg(3,"%s()\n",__func__);
+	ses->gb[0] = RET_STD[0];
+	ses->gb[1] = RET_STD[1];
+	ses->gb[2] = err;
+	ses->gb[3] = checksum(ses->gb);
+	ses->st_err = err;
+	dbg(3,"Response: %02X\n",err);
+	write_client_tty(ses,ses->gb,ses->gb[1]+3);
+	if (ses->gb[2]!=ERR_SUCCESS) dbg(2,"ERROR RESPONSE TO CLIENT\n");
+}
+
+/*
+ * Cold directory listing
+ *
+ * When the directory cache misses, the whole directory is read first, and
+ * everything that can be decided from the name and d_type is skipped right
+ * there, so that only the entries that get listed cost a stat(), which on
+ * a network share is a round trip each.
+ *
+ * Then the size, type and attr xattr of the rest are fetched. In a big
+ * directory that is done by up to dir_threads threads at once, each
+ * taking the next entry that nobody has taken yet, so on a slow network
+ * filesystem the time goes down with the number of threads. The threads
+ * only live for the one listing. Last, the entries are added to the list
+ * in readdir order, the same list that one thread would have made.
+ */
+
+#define DIR_SCAN_MIN 64 // entries per thread, fewer aren't worth a thread
+
+typedef struct {
+	char name[LOCAL_FILENAME_MAX+1];
+	char flags;
+	uint8_t attr;
+	bool err;    // fstatat() failed
+	bool skip;   // not a file, or a directory that isn't listed
+	off_t size;
+} DIR_ENT;
+
+typedef struct {
+	SESSION* ses;
+	int fd;
+	DIR_ENT* e;
+	int n;
+	atomic_int next;
+} DIR_SCAN;
+
+static void dir_scan_meta(DIR_SCAN* s, DIR_ENT* e) {
+	struct stat st;
+
+	// TS-DOS directories are listed as 0 bytes, nothing to stat() for
+	if (e->flags==FE_FLAGS_DIR && dme_en && ext_len) {
+		e->size = 0;
+	} else {
+		if (fstatat(s->fd,e->name,&st,0)) { e->err = true; return; }
+		if (S_ISDIR(st.st_mode)) e->flags=FE_FLAGS_DIR;
+		else if (!S_ISREG (st.st_mode)) { e->skip = true; return; }
+		if (e->flags==FE_FLAGS_DIR && s->ses->in_dme<2) { e->skip = true; return; }
+		e->size = st.st_size;
+	}
+
+	e->attr = default_attr;
+	dl_getxattrat(s->fd, e->name, &e->attr);
+}
+
+static void* dir_scan_worker(void* arg) {
+	DIR_SCAN* s = arg;
+	int i;
+	while ((i = atomic_fetch_add(&s->next,1)) < s->n) dir_scan_meta(s,&s->e[i]);
+	return NULL;
+}
+
+// add every file in dir to the list, 0 = done, -1 = failed
+static int dir_scan(SESSION* ses, DIR* dir, int m) {
+	dbg(3,"%s()\n",__func__);
+	DIR_SCAN s = { .ses = ses };
+	pthread_t th[DIR_THREADS_MAX];
+	struct dirent* dire;
+	sigset_t all, old;
+	FILE_ENTRY f;
+	DIR_ENT* t;
+	int i, w, nth = 0, max = 0, r = 0;
+	char flags;
+
+	if (dir == NULL) {
+		dbg(0,"%s(NULL) ???\n",__func__);
+		if (m) ret_std(ses,ERR_NO_DISK);
+		return -1;
+	}
+	s.fd = dirfd(dir);
+
+	while ((dire=readdir(dir)) != NULL) {
+		flags=FE_FLAGS_NONE;
+
+		if (base_len) {
+			if (dire->d_name[0]=='.') continue; // skip "." ".." and hidden files
+			if (strlen(dire->d_name)>LOCAL_FILENAME_MAX) continue; // skip long filenames
+		}
+
+#ifdef DT_UNKNOWN
+		switch (dire->d_type) {
+			case DT_DIR: flags=FE_FLAGS_DIR; break;
+			case DT_REG:
+			case DT_LNK:     // stat() says what it points to
+			case DT_UNKNOWN: // the filesystem doesn't say
+				break;
+			default: continue; // fifos, sockets, devices
+		}
+		if (flags==FE_FLAGS_DIR && ses->in_dme<2) continue;
+#endif
+
+		if (s.n>=max) {
+			max = max ? max*2 : DIR_SCAN_MIN;
+			if (!(t = realloc(s.e,max*sizeof(DIR_ENT)))) {
+				dbg(0,"%s: %s\n",ses->cwd,strerror(errno));
+				if (m) ret_std(ses,ERR_NO_FILE);
+				free(s.e);
+				return -1;
+			}
+			s.e = t;
+		}
+		memset(&s.e[s.n],0x00,sizeof(DIR_ENT));
+		strncpy(s.e[s.n].name,dire->d_name,LOCAL_FILENAME_MAX);
+		s.e[s.n++].flags = flags;
+	}
+
+	// this thread is one of the workers, the signals are for the main thread
+	w = MIN(dir_threads,s.n/DIR_SCAN_MIN);
+	if (w>DIR_THREADS_MAX) w = DIR_THREADS_MAX;
+	if (w>1) {
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK,&all,&old);
+		for (nth=0;nth<w-1;nth++) if (pthread_create(&th[nth],NULL,dir_scan_worker,&s)) break;
+		pthread_sigmask(SIG_SETMASK,&old,NULL);
+	}
+	dir_scan_worker(&s);
+	for (i=0;i<nth;i++) pthread_join(th[i],NULL);
+	if (nth) dbg(2,"%d entries, %d threads\n",s.n,nth+1);
+
+	for (i=0;i<s.n;i++) {
+		DIR_ENT* e = &s.e[i];
+		if (e->err) {
+			if (m) ret_std(ses,ERR_NO_FILE);
+			r = -1;
+			break;
+		}
+		if (e->skip) continue;
+
+		// TODO - make this configurable
+		// If filesize is too large for the tpdd 16 bit size field, then say
+		// size=0 but allow the file to be accessed.
+		// A real drive does NOT do this, but REXCPM cpmupd.CO
+		// violates the tpdd protocol to load a large CP/M disk image.
+		if (e->size>UINT16_MAX) e->size=0;
+
+		add_file(&ses->files,make_file_entry(&f,e->name,e->attr,e->size,e->flags));
+	}
+
+	free(s.e);
+	return r;
+}
+
+// read the current share directory
+void update_file_list(SESSION* ses, int m) {
+	dbg(3,"%s()\n",__func__);
+	DIR* dir;
+	FILE_ENTRY f;
+	int r;
+	long t = now_us();
+
+	ses->dirent_frames_n = 0;
+	ses->in_img = disk_fs && !img_fs_list(ses);
+	if (ses->in_img) {
+		dirent_frames_build(ses);
+		stats_time(&stat_dir,now_us()-t);
+		return;
+	}
+
+	if (model==2) cd_share_path(ses);
+
+	// use the snapshot if the directory hasn't changed since the last time
+	uint8_t k = (ses->bank?DC_KEY_BANK1:0) | (ses->in_dme>1?DC_KEY_DIRS:0) | (ses->dir_depth?DC_KEY_PARENT:0);
+	if (!dir_cache_load(&ses->files,ses->cwd,k)) {
+		dbg(2,"\nDirectory %s: %s (cached)\n",model==2?ses->bank==1?"[Bank 1]":"[Bank 0]":"",ses->cwd);
+		dirent_frames_build(ses);
+		return;
+	}
+
+	dir = NULL;
+	if ((r = openat(ses->dir_fd,".",O_RDONLY|O_DIRECTORY|O_CLOEXEC))>=0 && !(dir = fdopendir(r))) close(r);
+	file_list_clear_all(&ses->files);
+
+	//int w = base_len+1+ext_len;
+	//if (base_len<1||w>TPDD_FILENAME_LEN) w = TPDD_FILENAME_LEN;
+	dbg(1,"\nDirectory %s: %s\n",model==2?ses->bank==1?"[Bank 1]":"[Bank 0]":"",ses->cwd);
+	/* match format with end of make_file_entry() */
+	dbg(1,"\"%-*s\"  |a|  local filename\n",cfnl,"tpdd view");
+	dbg(1,"-------------------------------------------------------------------------------\n");
+	if (ses->dir_depth) add_file(&ses->files,make_file_entry(&f,"..", default_attr, 0, FE_FLAGS_DIR));
+	r = dir_scan(ses,dir,m);
+	dbg(1,"-------------------------------------------------------------------------------\n");
+	if (dir) closedir(dir);
+	if (!r) dir_cache_store(&ses->files,ses->cwd,k);
+	dirent_frames_build(ses);
+	stats_time(&stat_dir,now_us()-t);
+}
+
+/*
+ * RET_DIRENT frames
+ *
+ * The whole listing is encoded into dirent_frames[] every time
+ * update_file_list() builds or loads it, one DIRENT_FRAME_LEN frame per
+ * entry in files order, plus the not-found/end frame after the last one.
+ * get-first/get-next/get-prev are then a single write of a frame that is
+ * already there. Anything not in the table, like new_file, is encoded
+ * into gb[] on the spot as before.
+ */
+
+// encode the response for ep (may be null) into b
+static void dirent_frame(uint8_t* b, FILE_ENTRY* ep, uint8_t free_sectors) {
+	int i;
+
+	memset(b,0x00,DIRENT_FRAME_LEN);
+	b[0] = RET_DIRENT[0];
+	b[1] = RET_DIRENT[1];
+
+	if (ep) {
+		// name
+		memset (b + 2, ' ', TPDD_FILENAME_LEN);
+		if (ep->flags&FE_FLAGS_IMG) memcpy (b+2,ep->client_fname,strlen(ep->client_fname)); // as it is on the disk
+		else if (base_len) for (i=0;i<base_len+3;i++)
+			b[i+2] = (ep->client_fname[i])?ep->client_fname[i]:' ';
+		else memcpy (b+2,ep->client_fname,TPDD_FILENAME_LEN);
+
+		// attribute
+		b[26] = ep->attr;
+
+		// size
+		b[27] = (uint8_t)(ep->len >> 0x08); // most significant byte
+		b[28] = (uint8_t)(ep->len & 0xFF);  // least significant byte
+	}
+
+	// free sectors
+	b[29] = free_sectors;
+
+	b[30] = checksum (b);
+}
+
+void dirent_frames_build(SESSION* ses) {
+	FILE_ENTRY* t = file_list_table(&ses->files);
+	unsigned i, n = file_list_len(&ses->files)+1;
+
+	ses->dirent_frames_n = 0;
+	if (n>ses->dirent_frames_max) {
+		uint8_t* p = realloc(ses->dirent_frames,n*DIRENT_FRAME_LEN);
+		if (!p) return; // ret_dirent() encodes them one at a time
+		ses->dirent_frames = p;
+		ses->dirent_frames_max = n;
+	}
+	for (i=0;i<n-1;i++) dirent_frame(ses->dirent_frames+i*DIRENT_FRAME_LEN,t+i,ses->dirent_free);
+	dirent_frame(ses->dirent_frames+i*DIRENT_FRAME_LEN,NULL,ses->dirent_free);
+	ses->dirent_frames_n = n;
+}
+
+// precomputed frame for ep, or NULL if it isn't one of the files
+static uint8_t* dirent_frame_of(SESSION* ses, FILE_ENTRY* ep) {
+	FILE_ENTRY* t = file_list_table(&ses->files);
+	unsigned n = ses->dirent_frames_n;
+	if (!n) return NULL;
+	if (!ep) return ses->dirent_frames+(n-1)*DIRENT_FRAME_LEN;
+	if (ep<t || ep>=t+n-1) return NULL;
+	return ses->dirent_frames+(ep-t)*DIRENT_FRAME_LEN;
+}
+
+// re-encode ep after changing it in place
+void dirent_frame_update(SESSION* ses, FILE_ENTRY* ep) {
+	uint8_t* b = dirent_frame_of(ses,ep);
+	if (b && ep) dirent_frame(b,ep,ses->dirent_free);
+}
+
+// return for dirent
+int ret_dirent(SESSION* ses, FILE_ENTRY* ep) {
+	// ep may be null
+	dbg(2,"%s()\n",__func__);
+	uint8_t* b = dirent_frame_of(ses,ep);
+
+	if (!b) dirent_frame(b = ses->gb,ep,ses->dirent_free);
+
+	dbg(3,"\"%*.*s\" (%c) 0x%02X%02X\n",TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,b+2,b[26],b[27],b[28]);
+
+	return (write_client_tty(ses,b,DIRENT_FRAME_LEN) == DIRENT_FRAME_LEN);
+}
+
+void dirent_set_name(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	if (ses->gb[2]) {
+		dbg(3,"filename: \"%-*.*s\"\n",TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,ses->gb+2);
+		dbg(3,"    attr: \"%c\" (%1$02X)\n",ses->gb[26]);
+	}
+	char* p;
+	char filename[TPDD_FILENAME_LEN+1] = {0x00};
+	uint8_t fileattr = 0x00;
+	int f = 0;
+
+	// Update the local file list before every set-name.
+	// * clients may open files any time without ever listing first
+	// * local files may be changed at any time by other processes
+	// and we need to have the tpdd version of all filenames ready to compare
+	// against, to respond correctly if it exists/doesn't/writable/not etc.
+	// The directory is only actually re-read if it changed since the
+	// last time, see dir_cache.c
+	update_file_list(ses,ALLOW_RET);
+
+	// copy the filename from the buffer
+	strncpy(filename,(char*)ses->gb+2,TPDD_FILENAME_LEN);
+	filename[TPDD_FILENAME_LEN]=0x00;
+	fileattr = ses->gb[26];
+
+	// Remove trailing spaces
+	for (p = strrchr(filename,' ');p >= filename && *p == ' ';p--) *p = 0x00;
+
+	ses->cur_file = find_file(&ses->files, filename, fileattr);
+
+	if (ses->cur_file) {
+		dbg(3,"Exists: \"%s\"  %u\n", ses->cur_file->local_fname, ses->cur_file->len);
+		ret_dirent(ses,ses->cur_file);
+	} else if (ses->in_img) {
+		img_fs_entry(&ses->new_file, filename, fileattr, 0);
+		ses->cur_file = &ses->new_file;
+		dbg(3,"New File: \"%s\"\n",filename);
+		ret_dirent(ses,NULL);
+	} else if (!check_magic_file(filename)) {
+		// let UR2/TSLOAD load DOSxxx.CO from anywhere
+		make_file_entry(&ses->new_file, filename, fileattr, 0, 0);
+		ses->cur_file = &ses->new_file;
+		char t[LOCAL_FILENAME_MAX+1] = {0x00};
+		// try share root
+		// TODO - save initial share_path[0] and use that instead of "../"*depth
+		// tpdd2 can't do dme, so share_path[1] is available
+		for (int i=ses->dir_depth;i>0;i--) strcat(t,"../");
+		strncat(t,ses->cur_file->local_fname,LOCAL_FILENAME_MAX-ses->dir_depth*3);
+		struct stat st; int e = fstatat(ses->dir_fd, t, &st, 0);
+		if (e) { // try app_lib_dir
+			strcpy(t,app_lib_dir);
+			strcat(t,"/");
+			strcat(t,ses->cur_file->local_fname);
+			e=stat(t,&st);
+		}
+		if (e) ret_dirent(ses,NULL); // not found
+		else { // found in share root or in app_lib_dir
+			strcpy(ses->cur_file->local_fname,t);
+			ses->cur_file->len=st.st_size;
+			dbg(3,"Magic: \"%s\" <-- \"%s\"\n",ses->cur_file->client_fname,ses->cur_file->local_fname);
+			ret_dirent(ses,ses->cur_file);
+		}
+	} else {
+		if (!strncmp(filename+base_len+1,dme_dir_label,2)) f = FE_FLAGS_DIR;
+		make_file_entry(&ses->new_file, collapse_padded_fname(filename), fileattr, 0, f);
+		ses->cur_file = &ses->new_file;
+		dbg(3,"New %s: \"%s\"\n",f==FE_FLAGS_DIR?"Directory":"File",ses->cur_file->local_fname);
+		ret_dirent(ses,NULL);
+	}
+}
+
+void dirent_get_first(SESSION* ses) {
+	dbg(2,"Directory Listing\n");
+	// update every time before get-first,
+	// because set-name is not required before get-first
+	update_file_list(ses,ALLOW_RET);
+	ret_dirent(ses,get_first_file(&ses->files));
+	ses->in_dme = 0; // exit dme - see req_fdc()
+}
+
+// b[0] = cmd
+// b[1] = len
+// b[2]-b[25] = filename
+// b[26] = attr
+// b[27] = action (search form)
+//
+// Ignore the name & attr until after determining the action.
+// TS-DOS submits get-first & get-next requests with junk data
+// in the filename & attribute fields left over from previous actions.
+int req_dirent(SESSION* ses) {
+	if (debug>1) {
+		dbg(2,"%s(%s)\n",__func__,
+			ses->gb[27]==DIRENT_SET_NAME?"set_name":
+			ses->gb[27]==DIRENT_GET_FIRST?"get_first":
+			ses->gb[27]==DIRENT_GET_NEXT?"get_next":
+			ses->gb[27]==DIRENT_GET_PREV?"get_prev":
+			ses->gb[27]==DIRENT_CLOSE?"close":
+			"UNKNOWN"
+		);
+		dbg(5,"gb[]\n");
+		dbg_b(5,ses->gb,-1);
+		dbg_p(4,ses->gb);
+	}
+
+	switch (ses->gb[27]) {
+		case DIRENT_SET_NAME:  dirent_set_name(ses);                       break;
+		case DIRENT_GET_FIRST: dirent_get_first(ses);                      break;
+		case DIRENT_GET_NEXT:  ret_dirent(ses,get_next_file(&ses->files)); break;
+		case DIRENT_GET_PREV:  ret_dirent(ses,get_prev_file(&ses->files)); break;
+		case DIRENT_CLOSE:                                                 break;
+	}
+	return 0;
+}
+
+// update dme_cwd with current dir, truncated & padded both required
+// If you don't send all 6 bytes, TS-DOS doesn't clear the previous
+// contents from the display
+void update_dme_cwd(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	update_cwd(ses);
+	if (!dme_en) return;
+
+	int i;
+	dbg(0,"Changed Dir: %s\n",ses->cwd);
+	if (ses->dir_depth) {
+		for (i=strlen(ses->cwd); i>=0 ; i--) if (ses->cwd[i]=='/') break;
+		snprintf(ses->dme_cwd,base_len+1,"%-*.*s",6,6,ses->cwd+1+i);
+		// only the label, ses->cwd is still the real path
+		if (upcase) for (i=0;ses->dme_cwd[i];i++) ses->dme_cwd[i]=toupper(ses->dme_cwd[i]);
+	} else {
+		memcpy(ses->dme_cwd,dme_root_label,6);
+	}
+}
+
+// TS-DOS DME return
+// Construct a DME packet around dme_cwd and send it to the client
+void ret_dme_cwd(SESSION* ses) {
+	dbg(2,"%s(\"%s\")\n",__func__,ses->dme_cwd);
+	if (!dme_en) return;
+	ses->gb[0] = RET_STD[0];
+	ses->gb[1] = 0x0B;   // not RET_STD[1] because TS-DOS DME violates the spec
+	ses->gb[2] = 0x00;   // don't know why this byte is 0
+	memcpy(ses->gb+3,ses->dme_cwd,6); // 6 bytes 3-8 display in top-right corner
+	ses->gb[9] = 0x00;   // gb[9]='.';  // remaining contents don't matter but length does
+	ses->gb[10] = 0x00;  // gb[10]=dme_dir_label[0];
+	ses->gb[11] = 0x00;  // gb[11]=dme_dir_label[1];
+	ses->gb[12] = 0x00;  // gb[12]=0x20;
+	ses->gb[13] = checksum(ses->gb);
+	write_client_tty(ses,ses->gb,14);
+}
+
+// The "switch to FDC-mode" command requires careful handling, because
+// unlike the original Desk-Link, we actually support the FDC commands,
+// and need the "switch-to-fdc-mode" command to work like a real drive.
+//
+// So here we always look for TS-DOS "DME" request and set a "we're doing dme"
+// flag, but only for the duration of a single directory listing process.
+// The first stage of a directory listing, dirent(get-first), clears the dme
+// flag so that FDC commands immediatly go back to working like a real drive.
+//
+// Any FDC request might actually be a DME request
+// See ref/dme.txt for the full explaination
+void req_fdc(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+
+	// TPDD1 does not send back any response
+	// TPDD2 returns a standard 0x12 return packet with 0x36 payload
+	//
+	// You can't have both full TPDD2 emulation including banks,
+	// and TS-DOS directories support at the same time.
+	//
+	// If we recognize a DME request and respond with a DME return, then you get
+	// TS-DOS subdirecties, but then TS-DOS does not show a Bank button,
+	// even if we had otherwise responded as a TPDD2 ie with the tpdd2 version
+	// packet and working tpdd2-only features like dirent(get-prev).
+	//
+	// If we are in tpdd2 mode and reject the DME request like a real tpdd2,
+	// then TS-DOS does show the Bank button and you can switch banks 0 & 1.
+	if (model==2) { ret_std(ses,ERR_PARAM); return; }
+
+	// Some versions of TS-DOS send 2 FDC requests in a row, both with trailing
+	// 0x0D. Some versions also send a 3rd FDC request without the trailing 0x0D.
+	// Look for 2 consecutive FDC requests with trailing 0x0D. Once we see that,
+	// don't try to read a trailing 0x0D any more to avoid reading the command
+	// byte of a real FDC command, and respond to the 2nd and any other FDC
+	// requests with DME response instead of switching to FDC mode, as long as in_dme>1.
+	// in_dme is only set here, and only unset in dirent_get_first()
+	if (ses->in_dme<2 && dme_en) {
+		// Look at one more byte without consuming it. It stays in rx_buf[]
+		// where get_fdc_cmd() will pick it up in case we do switch to FDC-mode,
+		// either as the first byte of an actual FDC command, or as the trailing
+		// 0x0D of the first DME request, which a real drive answers as an
+		// empty command.
+		// Timeout fast whether there is a byte or not.
+		//dbg(3,"looking for dme req %d of 2\n",in_dme+1);
+		if (!rx_avail() && rx_wait(ses,100)>0) rx_fill(ses); // time out fast
+		if (rx_avail() && rx_peek(0)==FDC_CMD_EOL) dbg(3,"Got dme req %d of 2\n",++ses->in_dme);
+	}
+	if (ses->in_dme>1) {
+		if (rx_avail() && rx_peek(0)==FDC_CMD_EOL) ses->rx_head++; // eat the trailing 0x0D
+		ret_dme_cwd(ses);
+	} else {
+		ses->operation_mode = MODE_FDC;
+		dbg(2,"Switched to \"FDC\" mode\n"); // no response to client, just switch modes
+	}
+}
+
+// Top up the read-ahead window with as much of the file as fits.
+// req_read() only calls this when less than a full packet is left,
+// so a file that fits in the window is read with one read() at open,
+// and a big one with one read() per READ_AHEAD_LEN instead of per packet.
+void ra_fill(SESSION* ses) {
+	int i;
+	if (ses->ra_head) {
+		memmove(ses->ra_buf,ses->ra_buf+ses->ra_head,ses->ra_tail-ses->ra_head);
+		ses->ra_tail -= ses->ra_head;
+		ses->ra_head = 0;
+	}
+	while (ses->ra_tail<READ_AHEAD_LEN) {
+		i = read(ses->o_file_h, ses->ra_buf+ses->ra_tail, READ_AHEAD_LEN-ses->ra_tail);
+		if (i<0) dbg(0,"%s\n",strerror(errno));
+		if (i<=0) break;
+		ses->ra_tail += i;
+	}
+}
+
+// b[0] = fmt  0x01
+// b[1] = len  0x01
+// b[2] = mode 0x01 write new
+//             0x02 write append
+//             0x03 read
+// b[3] = chk
+int req_open(SESSION* ses) {
+	if (debug>1) {
+		dbg(2,"%s(\"%s\",\"%c\")\n",__func__,ses->cur_file->client_fname,ses->cur_file->attr);
+		dbg(5,"gb[]\n");
+		dbg_b(5,ses->gb,-1);
+		dbg_p(4,ses->gb);
+	}
+
+	uint8_t omode = ses->gb[2];
+
+	if (ses->cur_file && ses->cur_file->flags&FE_FLAGS_IMG) {
+		close_o_file(ses);
+		uint8_t e = img_fs_open(ses,omode);
+		if (!e) dbg(1,"Open for %s: \"%s\" (%c) in disk image\n",omode==F_OPEN_READ?"read":omode==F_OPEN_WRITE?"write":"append",ses->img_name,ses->img_attr);
+		ret_std(ses,e);
+		return ses->img_bank;
+	}
+
+	switch(omode) {
+		case F_OPEN_WRITE:
+			dbg(2,"mode: write\n");
+			close_o_file(ses);
+			if (ses->cur_file->flags&FE_FLAGS_DIR) {
+				if (!mkdirat(ses->dir_fd,ses->cur_file->local_fname,0777)) {
+					dir_cache_invalidate(ses->cwd);
+					ret_std(ses,ERR_SUCCESS);
+				} else {
+					ret_std(ses,ERR_FMT_MISMATCH);
+				}
+			} else {
+				ses->o_file_h = openat(ses->dir_fd,ses->cur_file->local_fname,O_CREAT|O_TRUNC|O_WRONLY|O_EXCL|O_CLOEXEC,0666);
+				if (ses->o_file_h<0)
+					ret_std(ses,ERR_FMT_MISMATCH);
+				else {
+					ses->f_open_mode=omode;
+					ses->wb_len = 0;
+					dl_fsetxattr(ses->o_file_h, &ses->cur_file->attr);
+					dbg(1,"Open for write: \"%s\" (%c)\n",ses->cur_file->local_fname,ses->cur_file->attr);
+					ret_std(ses,ERR_SUCCESS);
+				}
+			}
+			break;
+		case F_OPEN_APPEND:
+			dbg(2,"mode: append\n");
+			close_o_file(ses);
+			if (ses->cur_file==0) {
+				ret_std(ses,ERR_FMT_MISMATCH);
+				return -1;
+			}
+			ses->o_file_h = openat(ses->dir_fd, ses->cur_file->local_fname, O_WRONLY | O_APPEND | O_CLOEXEC);
+			if (ses->o_file_h < 0)
+				ret_std(ses,ERR_FMT_MISMATCH);
+			else {
+				ses->f_open_mode=omode;
+				ses->wb_len = 0;
+				dl_fsetxattr(ses->o_file_h, &ses->cur_file->attr);
+				dbg(1,"Open for append: \"%s\" (%c)\n",ses->cur_file->local_fname,ses->cur_file->attr);
+				ret_std(ses,ERR_SUCCESS);
+			}
+			break;
+		case F_OPEN_READ:
+			dbg(2,"mode: read\n");
+			close_o_file(ses);
+			if (ses->cur_file==0) {
+				ret_std(ses,ERR_NO_FILE);
+				return -1;
+			}
+	
+			if (ses->cur_file->flags&FE_FLAGS_DIR) {
+				int err=0;
+				// directory
+				if (ses->cur_file->local_fname[0]=='.' && ses->cur_file->local_fname[1]=='.') {
+					// parent dir
+					if (ses->dir_depth>0) {
+						err=session_cd(ses,"..");
+						if (!err) ses->dir_depth--;
+					}
+				} else {
+					// enter dir
+					err=session_cd(ses,ses->cur_file->local_fname);
+					if (!err) ses->dir_depth++;
+				}
+				update_dme_cwd(ses);
+				if (err) ret_std(ses,ERR_FMT_MISMATCH);
+				else ret_std(ses,ERR_SUCCESS);
+			} else {
+				// regular file
+				ses->o_file_h = openat(ses->dir_fd, ses->cur_file->local_fname, O_RDONLY | O_CLOEXEC);
+				if (ses->o_file_h<0)
+					ret_std(ses,ERR_NO_FILE);
+				else {
+					ses->f_open_mode = omode;
+					ses->ra_head = ses->ra_tail = 0;
+					ra_fill(ses);
+					dl_fgetxattr(ses->o_file_h, &ses->cur_file->attr);
+					dirent_frame_update(ses,ses->cur_file);
+					dbg(1,"Open for read: \"%s\" (%c)\n",ses->cur_file->local_fname,ses->cur_file->attr);
+					ret_std(ses,ERR_SUCCESS);
+				}
+			}
+			break;
+		default:
+			dbg(2,"Unrecognized mode: \"0x%02X\"\n",omode);
+			ret_std(ses,ERR_PARAM);
+			break;
+	}
+	return ses->o_file_h;
+}
+
+void req_read(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	int i;
+
+	if (ses->o_file_h<0 && ses->img_bank<0) {
+		ret_std(ses,ERR_NO_FNAME);
+		return;
+	}
+	if (ses->f_open_mode!=F_OPEN_READ) {
+		ret_std(ses,ERR_FMT_MISMATCH);
+		return;
+	}
+
+	if (ses->ra_tail-ses->ra_head<REQ_RW_DATA_MAX && ses->o_file_h>=0) ra_fill(ses);
+	i = ses->ra_tail-ses->ra_head;
+	if (i>REQ_RW_DATA_MAX) i = REQ_RW_DATA_MAX;
+	memcpy(ses->gb+2,ses->ra_buf+ses->ra_head,i);
+	ses->ra_head += i;
+
+	ses->gb[0] = RET_READ;
+	ses->gb[1] = (uint8_t)i;
+	ses->gb[2+i] = checksum(ses->gb);
+
+	if (debug<2) {
+		dbg(1,".");
+		if (i<REQ_RW_DATA_MAX) dbg(1,"\n"); // final packet
+	}
+
+	if (debug>1) {
+		dbg(4,"...outgoing packet...\n");
+		dbg(5,"gb[]\n");
+		dbg_b(5,ses->gb,-1);
+		dbg_p(4,ses->gb);
+		dbg(4,".....................\n");
+	}
+
+	write_client_tty(ses,ses->gb, 3+i);
+}
+
+// b[0] = 0x04
+// b[1] = 0x01 - 0x80
+// b[2] = b[1] bytes
+// b[2+len] = chk
+void req_write(SESSION* ses) {
+	if (debug>1) {
+		dbg(2,"%s()\n",__func__);
+		dbg(4,"...incoming packet...\n");
+		dbg(5,"gb[]\n");
+		dbg_b(5,ses->gb,-1);
+		dbg_p(4,ses->gb);
+		dbg(4,".....................\n");
+	}
+
+	if (ses->o_file_h<0 && ses->img_bank<0) {ret_std(ses,ERR_NO_FNAME); return;}
+
+	if (ses->f_open_mode!=F_OPEN_WRITE && ses->f_open_mode !=F_OPEN_APPEND) {
+		ret_std(ses,ERR_FMT_MISMATCH);
+		return;
+	}
+
+	if (debug<2) {
+		dbg(1,".");
+		if (ses->gb[1]<REQ_RW_DATA_MAX) dbg(1,"\n"); // final packet
+	}
+
+	if (ses->wb_len+ses->gb[1]>WRITE_BEHIND_LEN) wb_flush(ses);
+	if (ses->wb_err) { ret_std(ses,ses->wb_err); return; }
+	memcpy(ses->wb_buf+ses->wb_len,ses->gb+2,ses->gb[1]);
+	ses->wb_len += ses->gb[1];
+	ret_std(ses,ERR_SUCCESS);
+}
+
+void req_delete(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	if (ses->cur_file && ses->cur_file->flags&FE_FLAGS_IMG) {
+		uint8_t e = img_fs_delete(ses);
+		if (!e) dbg(1,"Deleted: %s from disk image\n",ses->cur_file->client_fname);
+		ret_std(ses,e);
+		return;
+	}
+	if (ses->cur_file->flags&FE_FLAGS_DIR) unlinkat(ses->dir_fd, ses->cur_file->local_fname, AT_REMOVEDIR);
+	else unlinkat(ses->dir_fd, ses->cur_file->local_fname, 0);
+	dir_cache_invalidate(ses->cwd);
+	dbg(1,"Deleted: %s\n",ses->cur_file->local_fname);
+	ret_std(ses,ERR_SUCCESS);
+}
+
+
+/*
+ * PDD2 cache load, cache commit, mem read, mem write
+ * 
+ * Emulating access to the sector cache is straightforward.
+ * Emulating access to the cpu memory is less so.
+ *
+ * The command allows to read from anywhere in the cpus address space,
+ * but we wouldn't know what to return for much of that.
+ *
+ * We recognize a few special addresses and just return "success"
+ * for all other access to the cpu area without actually doing anything.
+ *
+ * cpu memory map:
+ * 0000-001F cpu i/o port
+ * 0080-00FF cpu internal ram 128 bytes
+ * 4000-4002 gate array (floppy controller)
+ * 8000-87FF ram 2k bytes
+ * F000-FFFF cpu internal rom 4k bytes
+ *
+ * Some cpu_memory writes observed from common clients, not including ZZ or checksum:
+ *
+ * fmt        len    area   offset      data
+ * BACKUP.BA
+ * 0x31,      0x04,  0x01,  0x00,0x83,  0x00,
+ * 0x31,      0x04,  0x01,  0x00,0x96,  0x00,
+ * 0x31,      0x07,  0x01,  0x80,0x04,  0x16,0x00,0x00,0x00    (data varies) this is the only one we actually do anything
+ *
+ * TS-DOS
+ * 0x31,      0x04,  0x01,  0x00,0x84,  0xFF,
+ * 0x31,      0x04,  0x01,  0x00,0x96,  0x0F,
+ * 0x31,      0x04,  0x01,  0x00,0x94,  0x0F,
+ *
+ * pdd2 service manual p102 says:
+ *   Reset Drive Status
+ *     write FF to 0084
+ *     write 0F to 0096
+ *     write 0F to 0094
+ *
+ */
+
+// also the return format for mem_write and undocumented 0x0F
+void ret_cache(SESSION* ses, uint8_t e) {
+	dbg(3,"%s()\n",__func__);
+	ses->gb[0] = RET_CACHE[0];
+	ses->gb[1] = RET_CACHE[1];
+	ses->gb[2] = e;
+	ses->gb[3] = checksum(ses->gb);
+	ses->st_err = e;
+	write_client_tty(ses,ses->gb,4);
+}
+
+/*
+ * Load a sector from disk into ram[],
+ * or commit ram[] to a sector on the disk.
+ *
+ * Committing the cache to disk does NOT clear the cache in ram.
+ *
+ * Load/Commit Cache
+ * b[0] fmt 0x30
+ * b[1] len 0x05
+ *   b[2] action 0=load (cache<disk) 1=commit (cache>disk) 2=commit+verify
+ *   b[3] track msb - (always 00)
+ *   b[4] track lsb - 00-4F
+ *   b[5] side (always 00)
+ *   b[6] sector 0-1
+ */
+void req_cache(SESSION* ses) {
+	dbg(3,"%s(action=%u track=%u sector=%u)\n",__func__,ses->gb[2],ses->gb[4],ses->gb[6]);
+	if (model==1) return;
+	uint8_t a=ses->gb[2];
+	//uint_16_t t=b[3]*256+b[4]; // b[3] is always 0
+	uint8_t t=ses->gb[4];
+	//int d=gb[5]; // side#? - always 0
+	uint8_t s=ses->gb[6]; // sector
+	if (t>=PDD2_TRACKS || s>=PDD2_SECTORS) { ret_cache(ses,ERR_PARAM); return; }
+	uint8_t rn = t*2 + s; // convert track#:sector# to linear record#
+	uint8_t e = ERR_SUCCESS;
+
+	switch (a) {
+		case CACHE_LOAD:
+			dbg(2,"cache load: track:%u  sector:%u\n",t,s);
+
+			// find the record in the disk image
+			if ((e = open_disk_image(ses,rn,O_RDONLY))) break;
+
+			// virtual 2k drive ram
+			memset(ses->ram,0x00,RAM_LEN); // 2k ram at 0x8000 - 0x87FF
+			ses->ram[0]=PDD2_CACHE_LEN_MSB; // len MSB - always 0x05
+			ses->ram[1]=PDD2_CACHE_LEN_LSB; // len LSB - always 0x13
+			ses->ram[2]=rn;   // linear sector number (0-159)
+			//ram[0x03]=0x00; // side number? - always 0
+			memcpy(ses->ram+PDD2_ID_REL,ses->disk_rec,SECTOR_HEADER_LEN);
+			//ram[0x11]= // unknown but changes when other data changes, crc msb?
+			//ram[0x12]= // unknown but changes when other data changes, crc lsb?
+			memcpy(ses->ram+PDD2_DATA_REL,ses->disk_rec+SECTOR_HEADER_LEN,SECTOR_DATA_LEN);
+			//ram[0x0513]= // unknown
+			//...          //
+			//ram[0x07FF]= // end of 2k ram
+			close_disk_image(ses);
+			break;
+
+		case CACHE_COMMIT:   // write cache to disk
+		case CACHE_COMMIT_VERIFY: // write cache to disk and verify
+
+			// find the record in the disk image, create the image if needed
+			dbg(2,"cache commit: track:%u  sector:%u\n",t,s);
+			if ((e = open_disk_image(ses,rn,O_WRONLY))) break;
+			memcpy(ses->disk_rec,ses->ram+PDD2_ID_REL,SECTOR_HEADER_LEN);
+			memcpy(ses->disk_rec+SECTOR_HEADER_LEN,ses->ram+PDD2_DATA_REL,SECTOR_DATA_LEN);
+			disk_img_commit(rn);
+			close_disk_image(ses);
+			break;
+		default: e = ERR_PARAM;
+	}
+	dbg_b(3,ses->ram,RAM_LEN);
+	if (e) dbg(2,"FAILED\n");
+	ret_cache(ses,e);
+}
+
+/*
+ * req:
+ * b[0] fmt req_mem_read
+ * b[1] len 4
+ *      b[2] area        0=sector_cache 1=cpu_memory
+ *      b[3] offset msb  0000-0500      0000-8FFF
+ *      b[4] offset lsb
+ *      b[5] dlen        00-FC
+ * b[6] chk
+ *
+ * ret:
+ * b[0] fmt ret_mem_read
+ * b[1] len (dlen+3)
+ *      b[2] area        0=sector_cache 1=cpu_memory
+ *      b[3] offset msb
+ *      b[4] offset lsb
+ *      b[5+] data       dlen bytes
+ * b[#] chk
+ */
+void req_mem_read(SESSION* ses) {
+	dbg(3,"%s()\n",__func__);
+	if (model==1) return;
+	uint8_t a = ses->gb[2];
+	uint16_t o = ses->gb[3]*256+ses->gb[4];
+	uint8_t l = ses->gb[5];
+	uint8_t e = ERR_SUCCESS;
+	uint8_t* src = ses->ram; // source of virtual ram data, ram[], rom[], etc
+	switch (a) {
+		case MEM_CACHE:
+			dbg(2,"mem_read: cache  offset:0x%04X  len:0x%02X\n",o,l);
+			if (o+l>SECTOR_DATA_LEN || l>PDD2_MEM_READ_MAX) e=ERR_PARAM;
+			o+=PDD2_DATA_REL;
+			break;
+		case MEM_CPU:
+			dbg(2,"mem_read: cpu  addr:0x%04X  len:0x%02X\n",o,l);
+			if (o>=IOPORT_ADDR && o<IOPORT_ADDR+IOPORT_LEN) { src=ses->ioport; o-=IOPORT_ADDR; break; }
+			if (o>=CPURAM_ADDR && o<CPURAM_ADDR+CPURAM_LEN) { src=ses->cpuram; o-=CPURAM_ADDR; break; }
+			if (o>=GA_ADDR && o<GA_ADDR+GA_LEN) { src=ses->ga; o-=GA_ADDR; break; }
+			if (o>=RAM_ADDR && o<RAM_ADDR+RAM_LEN) { o-=RAM_ADDR; break; }
+			if (o>=ROM_ADDR && o<ROM_ADDR+ROM_LEN) { src=rom; o-=ROM_ADDR; break; }
+			break;
+		default: e=ERR_PARAM;
+	}
+	if (e) { dbg(1,"mem_read: ERROR: 0x%02X  area:0x%02X  offset:0x%04X  len:0x%02X\n",e,a,o,l); ret_cache(ses,e); return; }
+
+	// copy some data from src[] and return to client
+	ses->gb[0] = RET_MEM_READ;
+	ses->gb[1] = 3+l;  // len = area(1 byte) + offset(2 bytes) + data(1-252 bytes)
+	//gb[2] = gb[2]; // area
+	//gb[3] = gb[3]; // offset msb
+	//gb[4] = gb[4]; // offset lsb
+	memcpy(ses->gb+5,src+o,l); // data
+	ses->gb[2+ses->gb[1]] = checksum(ses->gb); // chk
+	dbg_b(3,ses->gb,-1);
+	write_client_tty(ses,ses->gb,ses->gb[1]+3);
+}
+
+/*
+ * TPDD2 mem write
+ * 
+ * b[0] fmt
+ * b[1] len
+ *      b[2] area  0=sector_cache  1=cpu_memory
+ *      b[3] addr msb - address or offset, 2 bytes
+ *      b[4] addr lsb
+ *      b[5+] data
+ * b[#] chk
+ */
+void req_mem_write(SESSION* ses) {
+	dbg(3,"%s()\n",__func__);
+	if (model==1) return;
+	uint8_t a = ses->gb[2];
+	uint16_t o = ses->gb[3]*256+ses->gb[4];
+	uint8_t s = 5; // start of data
+	uint8_t l = ses->gb[1]-3; // length of data = length of packet - 3
+	uint8_t e = ERR_SUCCESS;
+	uint8_t* src = ses->ram; // source of virtual ram data, ram[], rom[], etc
+	switch (a) {
+		case MEM_CACHE:
+			dbg(2,"mem_write: cache  offset:0x%04X  len:0x%02X\n",o,l);
+			if (o+l>SECTOR_DATA_LEN || l>PDD2_MEM_WRITE_MAX) e=ERR_PARAM;
+			o+=PDD2_DATA_REL;
+			break;
+		case MEM_CPU:
+			dbg(2,"mem_write: cpu  addr:0x%04X  len:0x%02X\n",o,l);
+			if (o>=IOPORT_ADDR && o<IOPORT_ADDR+IOPORT_LEN) { src=ses->ioport; o-=IOPORT_ADDR; break; }
+			if (o>=CPURAM_ADDR && o<CPURAM_ADDR+CPURAM_LEN) { src=ses->cpuram; o-=CPURAM_ADDR; break; }
+			if (o>=GA_ADDR && o<GA_ADDR+GA_LEN) { src=ses->ga; o-=GA_ADDR; break; }
+			if (o>=RAM_ADDR && o<RAM_ADDR+RAM_LEN) { o-=RAM_ADDR; break; }
+			//if (o>=ROM_ADDR && o<ROM_ADDR+ROM_LEN) { src=rom; o-=ROM_ADDR; break; }
+			o-=RAM_ADDR;
+			break;
+		default: e=ERR_PARAM;
+	}
+	if (e) { dbg(1,"mem_write: ERROR: 0x%02X  area:0x%02X  offset:0x%04X  len:0x%02X\n",e,a,o,l); ret_cache(ses,e); return; }
+
+	// copy data from client over part of src[]
+	memcpy(src+o,ses->gb+s,l);
+	dbg_b(3,src+o,l);
+	ret_cache(ses,ERR_SUCCESS);
+}
+
+/*
+ * PDD2 get version
+ *
+ * Not including the ZZ or checksums:
+ * Client sends  : 23 00
+ * TPDD2 responds: 14 0F 41 10 01 00 50 05 00 02 00 28 00 E1 00 00 00
+ * TPDD1 does not respond.
+ *
+ * Some versions of TS-DOS use this to detect TPDD2, matching the entire packet,
+ * so we have to return this exact canned data if we want TS-DOS to know
+ * that it can use TPDD2 features. (not a big deal really)
+ *
+ */
+void ret_version(SESSION* ses) {
+	dbg(3,"%s()\n",__func__);
+	if (model==1) return;
+	ses->gb[0] = RET_VERSION[0];
+	ses->gb[1] = RET_VERSION[1];
+	ses->gb[2] = VERSION_MSB;
+	ses->gb[3] = VERSION_LSB;
+	ses->gb[4] = SIDES;
+	ses->gb[5] = TRACKS_MSB;
+	ses->gb[6] = TRACKS_LSB;
+	ses->gb[7] = SECTOR_SIZE_MSB;
+	ses->gb[8] = SECTOR_SIZE_LSB;
+	ses->gb[9] = SECTORS_PER_TRACK;
+	ses->gb[10] = DIRENTS_MSB;
+	ses->gb[11] = DIRENTS_LSB;
+	ses->gb[12] = MAX_FD;
+	ses->gb[13] = MODEL_CODE;
+	ses->gb[14] = VERSION_R0;
+	ses->gb[15] = VERSION_R1;
+	ses->gb[16] = VERSION_R2;
+	ses->gb[17] = checksum(ses->gb);
+	write_client_tty(ses,ses->gb,ses->gb[1]+3);
+}
+
+/*
+ * Similar to ret_version, except different data, and not used by TS-DOS.
+ * Real drives also respond to request 0x11 exactly the same as 0x33, though only 0x33 is documented.
+ * Not counting ZZ or checksums:
+ * Client sends  : 33 00
+ * TPDD2 responds: 3A 06 80 13 05 00 10 E1
+ */
+void ret_sysinfo(SESSION* ses) {
+	dbg(3,"%s()\n",__func__);
+	if (model==1) return;
+	ses->gb[0] = RET_SYSINFO[0];
+	ses->gb[1] = RET_SYSINFO[1];
+	ses->gb[2] = SECTOR_CACHE_START_MSB;
+	ses->gb[3] = SECTOR_CACHE_START_LSB;
+	ses->gb[4] = SECTOR_SIZE_MSB;
+	ses->gb[5] = SECTOR_SIZE_LSB;
+	ses->gb[6] = SYSINFO_CPU_CODE;
+	ses->gb[7] = MODEL_CODE;
+	ses->gb[8] = checksum(ses->gb);
+	write_client_tty(ses,ses->gb,ses->gb[1]+3);
+}
+
+void req_rename(SESSION* ses) {
+	dbg(3,"%s(%-*.*s)\n",__func__,TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,ses->gb+2);
+	if (model==1) return;
+	char *t = (char *)ses->gb + 2;
+	if (ses->cur_file && ses->cur_file->flags&FE_FLAGS_IMG) {
+		char n[TPDD_FILENAME_LEN+1] = {0x00};
+		memcpy(n,t,TPDD_FILENAME_LEN);
+		for (int i=TPDD_FILENAME_LEN;i>0 && n[i-1]==' ';i--) n[i-1] = 0x00;
+		uint8_t e = img_fs_rename(ses,n);
+		if (!e) dbg(1,"Renamed: %s -> %s in disk image\n",ses->cur_file->client_fname,n);
+		ret_std(ses,e);
+		return;
+	}
+	memcpy(t,collapse_padded_fname(t),TPDD_FILENAME_LEN);
+	if (renameat(ses->dir_fd,ses->cur_file->local_fname,ses->dir_fd,t))
+		ret_std(ses,ERR_SECTOR_NUM);
+	else {
+		dbg(1,"Renamed: %s -> %s\n",ses->cur_file->local_fname,t);
+		dir_cache_invalidate(ses->cwd);
+		ret_std(ses,ERR_SUCCESS);
+	}
+}
+
+void req_close(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	uint8_t e = close_o_file(ses);
+	ses->wb_err = ERR_SUCCESS;
+	dbg(2,"Closed: \"%s\"\n",ses->cur_file->local_fname);
+	ret_std(ses,e);
+}
+
+// also reports a deferred write error, see wb_flush()
+void req_status(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	uint8_t e = ses->wb_err;
+	ses->wb_err = ERR_SUCCESS;
+	ret_std(ses,e);
+}
+
+// TPDD2 only
+// response is 8 bit flags
+// 7 unused  MSB
+// 6 unused
+// 5 unused
+// 4 unused
+// 3 disk changed
+// 2 disk not inserted
+// 1 write protected
+// 0 low power
+void ret_condition(SESSION* ses) {
+	dbg(3,"%s()\n",__func__);
+	ses->gb[0] = RET_CONDITION[0];
+	ses->gb[1] = RET_CONDITION[1];
+	disk_check(ses);
+	ses->gb[2] = ses->pdd2_condition;
+	ses->gb[3] = checksum(ses->gb);
+	write_client_tty(ses,ses->gb,ses->gb[1]+3);
+	ses->pdd2_condition &= ~(1 << PDD2_COND_BIT_CHANGED); // reported once
+}
+
+void req_condition(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	if (model!=2) return;
+	ret_condition(ses);
+}
+
+// opr-format - this creates a disk that can load & save files
+// the only difference from fdc-format is a single byte, the first byte of the SMT
+// opr-format is just this:
+//   start with: fdc-format 0    (0=64-byte logical sector size)
+//   then: write 0x80 at sector 0 byte 1240 (aka physical:0 logical:20 byte:25 counting from 1)
+void req_format(SESSION* ses) {
+	dbg(2,"%s()\n",__func__);
+	const int rc = model==1?(PDD1_TRACKS*PDD1_SECTORS):(PDD2_TRACKS*PDD2_SECTORS); // records count
+	int rn = 0;          // record number
+
+	dbg(0,"Operation-mode Format (make a filesystem)\n");
+
+	uint8_t e = open_disk_image(ses,0,O_WRONLY);
+	if (e==ERR_READ_TIMEOUT) e=ERR_FMT_INTERRUPT;
+	if (e) { ret_std(ses,e); return; }
+
+	// write the image
+	// Real drive TPDD1 fresh Operation-mode format is strange.
+	// Any sector with any data gets LSC 0, and all others get LSC 1.
+	// Later, any sector that gets used by a file gets changed from LSC 1 to
+	// LSC 0, and never changed back even when files are deleted.
+	// A fresh format has one byte of data in sector 0 in the SMT,
+	// so a fresh format sector 0 has LSC 0 and all other sectors have LSC 1.
+	// We exactly mimick that here "just because", even though the LSC 1s
+	// don't seem to actually matter and we could just make all LSC 0.
+	for (rn=0;rn<rc;rn++) {
+		if (!(ses->disk_rec = disk_img_rec_w(rn))) break;
+		memset(ses->disk_rec,0x00,SECTOR_LEN);
+		switch (model) {
+			case 1: if (rn==0) ses->disk_rec[SECTOR_HEADER_LEN+SMT_OFFSET]=PDD1_SMT; else ses->disk_rec[0]=1; break;
+			default: ses->disk_rec[0]=0x16; if (rn<2) { ses->disk_rec[1]=0xFF; ses->disk_rec[SECTOR_HEADER_LEN+SMT_OFFSET]=PDD2_SMT; }
+		}
+	}
+
+	if (rn<rc) {
+		dbg(0,"format: record %d not in image\n",rn);
+		e = ERR_FMT_INTERRUPT;
+	}
+
+	disk_img_commit(-1);
+	close_disk_image(ses);
+	ret_std(ses,e);
+}
+
+/*
+ * req_exec() - execute program
+ *
+ * TPDD2 only
+ *
+ * Just a stub. Not likely to impliment any time soon,
+ * but might as well put the stub in to document it.
+ *
+ * TPDD2 util disk bootstrap uses this
+ */
+
+/* response from req_exec()
+ * returns the execution results from the cpu reisters A and X
+ * b[0] fmt (0x3B)
+ * b[1] len (0x03)
+ *      b[2] reg A - 1 byte
+ *      b[3] reg X msb - 2 bytes
+ *      b[4] reg X lsb
+ * b[5] chk
+*/
+void ret_exec(SESSION* ses, uint8_t reg_A, uint16_t reg_X) {
+	dbg(3,"%s(%u,%u)\n",__func__,reg_A,reg_X);
+	ses->gb[0] = RET_EXEC[0];
+	ses->gb[1] = RET_EXEC[1];
+	ses->gb[2] = reg_A;
+	ses->gb[3] = (uint8_t)(reg_X >> 0x08); // msb
+	ses->gb[4] = (uint8_t)(reg_X & 0xFF);  // lsb
+	ses->gb[5] = checksum(ses->gb);
+	write_client_tty(ses,ses->gb,6);
+}
+
+/* Load cpu registers A and X with supplied values, then jump to supplied address.
+ *
+ * examples:
+ * - jump to a rom routine
+ * - req_cache() to load a sector from disk first, then jump to the sector cache
+ * - req_mem_write() to write arbitrary code to cpu memory first, then jump to it
+ *
+ * b[0] fmt (0x34)
+ * b[1] len (0x05)
+ *      b[2] addr msb - execute address 2 bytes
+ *      b[3] addr lsb
+ *      b[4] reg A - 1 byte
+ *      b[5] reg X msb - 2 bytes
+ *      b[6] reg X lsb
+ * b[7] chk
+ */
+void req_exec(SESSION* ses) {
+	dbg(3,"%s() ***STUB***\n",__func__);
+	if (model==1) return;
+	uint16_t addr = ses->gb[2]*256+ses->gb[3];
+	uint8_t reg_A = ses->gb[4];
+	uint16_t reg_X = ses->gb[5]*256+ses->gb[6];
+	dbg(2,"exec:  addr:%u  A:%u  X:%u\n",addr,reg_A,reg_X);
+	/*
+	 * ...6301 emulator here...
+	 * executed code leaves new values in reg_A and reg_X
+	 */
+	dbg(2,"(stub, exec() not implimented)");
+	ret_exec(ses,reg_A,reg_X);
+}
+
+// Is a whole Operation-mode request buffered, so that get_opr_cmd() won't block?
+// Eats junk before the sync bytes the same way get_opr_cmd() would.
+bool opr_cmd_ready(SESSION* ses) {
+	while (rx_avail()>1 && !(rx_peek(0)==OPR_CMD_SYNC && rx_peek(1)==OPR_CMD_SYNC)) ses->rx_head++;
+	return rx_avail()>3 && rx_avail()>=rx_peek(3)+5u;
+}
+
+void get_opr_cmd(SESSION* ses) {
+	dbg(3,"%s()\n",__func__);
+	uint16_t i = 0;
+	unsigned h = ses->rx_head;
+	memset(ses->gb,0x00,TPDD_MSG_MAX);
+
+	// discard everything up to and including the sync bytes
+	while (i<2) {
+		rx_need(ses,1);
+		if (rx_getc()==OPR_CMD_SYNC) i++; else i=0;
+	}
+
+	// fmt, len, len bytes of payload, checksum
+	rx_need(ses,2);
+	i = rx_peek(1)+3;
+	rx_need(ses,i);
+	rx_take(ses,ses->gb,i);
+
+	dbg(3,"RCVD: "); dbg_b(3,ses->gb,i);
+	dbg_p(3,ses->gb);
+
+	if ((i=checksum(ses->gb))!=ses->gb[ses->gb[1]+2]) {
+		dbg(0,"Failed checksum: received: 0x%02X  calculated: 0x%02X\n",ses->gb[ses->gb[1]+2],i);
+		return; // real drive does not return anything
+	}
+
+	long t = now_us();
+	ses->st_out = 0;
+	ses->st_err = 0;
+
+	// Preserve the original packet for reference "just because" even though
+	// we could actually get away with modifying gb[0] at this point.
+	uint8_t c = ses->gb[0];
+
+	// decode bit 6 in the FMT byte b[0] for bank0 vs bank1
+	if (model==2) {
+		//bank = 0; if (c&0x40) { bank = 1; c-=0x40; } // alternative
+		ses->bank = (c >> 6) & 1; // read bit 6 to set bank 0 or 1
+		c &= ~(1 << 6);      // clear bit 6 so incoming 0x4# matches 0x0# case
+	}
+
+	// translate the undocumented synonyms
+	// https://www.mail-archive.com/m100@lists.bitchin100.com/msg18555.html
+	if ( c>0x0D && c<0x13 ) c+=0x22;
+
+	// TODO
+	// Test combinations of both of the above things on a real drive.
+	// Example, what does 0x51 do? Is it right that we test for 0x11
+	// after subtracting 0x40, so that we end up doing 0x33?
+	// Does tpdd1 do the 0x22 thing?
+
+	// dispatch
+	switch(c) {
+		case REQ_DIRENT:        req_dirent(ses);        break;
+		case REQ_OPEN:          req_open(ses);          break;
+		case REQ_CLOSE:         req_close(ses);         break;
+		case REQ_READ:          req_read(ses);          break;
+		case REQ_WRITE:         req_write(ses);         break;
+		case REQ_DELETE:        req_delete(ses);        break;
+		case REQ_FORMAT:        req_format(ses);        break;
+		case REQ_STATUS:        req_status(ses);        break;
+		case REQ_FDC:           req_fdc(ses);           break;
+		case REQ_CONDITION:     req_condition(ses);     break;
+		case REQ_RENAME:        req_rename(ses);        break;
+		case REQ_VERSION:       ret_version(ses);       break;
+		case REQ_CACHE:         req_cache(ses);         break;
+		case REQ_MEM_READ:      req_mem_read(ses);      break;
+		case REQ_MEM_WRITE:     req_mem_write(ses);     break;
+		case REQ_SYSINFO:       ret_sysinfo(ses);       break;
+		case REQ_EXEC:          req_exec(ses);          break;
+		default: dbg(1,"OPR: unknown cmd \"0x%02X\"\n",ses->gb[0]); dbg_p(1,ses->gb);
+		// local msg, nothing to client
+	}
+	stats_req(&stat_opr[c<STAT_OPR_LEN?c:STAT_OPR_LEN-1],t,ses->rx_head-h,ses->st_out,ses->st_err);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//  SERVING
+//
+
+// Handle everything that has arrived from the client, without waiting
+// for a new request. For a server that waits for input on several sessions
+// at once, and calls this when there is some. Only whole requests are
+// dispatched, and the rest stays buffered for the next time.
+int serve_session(SESSION* ses) {
+	switch (setjmp(ses->jmp)) {
+		case SES_DROP_CMD: return SES_OK;
+		case SES_CLOSE: return SES_CLOSE;
+		case SES_QUIT: return SES_QUIT;
+	}
+	dbg(2,"\n[%s]\n",ses->tty_name);
+	rx_fill(ses);
+	while (ses->operation_mode==MODE_FDC ? fdc_cmd_ready(ses) : opr_cmd_ready(ses))
+		switch (ses->operation_mode) {
+			case MODE_FDC: get_fdc_cmd(ses); break;
+			default: get_opr_cmd(ses); break;
+		}
+	return SES_OK;
+}
+
+// Process commands until the client goes away or quit_sig is set.
+int serve_client(SESSION* ses) {
+	switch (setjmp(ses->jmp)) {
+		case SES_CLOSE: return SES_CLOSE;
+		case SES_QUIT: return SES_QUIT;
+	}
+	while (1) switch (ses->operation_mode) {
+		case MODE_FDC: get_fdc_cmd(ses); break;
+		default: get_opr_cmd(ses); break;
+	}
+}
@@ -0,0 +1,221 @@
+// TPDD protocol engine
+//
+// The Operation-mode and FDC-mode request handlers, and everything they
+// need, built as libtpdd.a. main.c is the command line, tty setup,
+// bootstrap, and the server loop around it.
+//
+// All the state of one client connection is in a SESSION, and every
+// handler is given the session it works on. Any number of sessions can be
+// served in one process, from any threads, as long as each one is only
+// served by one thread at a time. The directory cache and the disk image
+// are shared, and lock for themselves.
+//
+// A session talks to its client through tty_fd, which doesn't have to be
+// a tty. Anything that can be read and written, like one end of a
+// socketpair(), works the same.
+
+#ifndef TPDD_H
+#define TPDD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <termios.h>
+#include <sys/param.h>
+
+#include "constants.h"
+#include "dir_list.h"
+#include "disk_img.h"
+
+#ifndef APP_LIB_DIR
+#define APP_LIB_DIR "."
+#endif
+
+// default model emulation, 1=pdd1 2=pdd2
+// TS-DOS sub-directories requires tpdd1
+#ifndef DEFAULT_MODEL
+#define DEFAULT_MODEL 1
+#endif
+
+#ifndef DEFAULT_UPCASE
+#define DEFAULT_UPCASE false
+#endif
+
+#ifndef DEFAULT_OPERATION_MODE
+#define DEFAULT_OPERATION_MODE MODE_OPR
+#endif
+
+#ifndef DEFAULT_TILDES
+#define DEFAULT_TILDES true
+#endif
+
+// fsync() files written by the client when they are closed
+#ifndef DEFAULT_FSYNC
+#define DEFAULT_FSYNC false
+#endif
+
+// file commands use the filesystem in the disk image, if it has one, see img_fs.c
+#ifndef DEFAULT_DISK_FS
+#define DEFAULT_DISK_FS true
+#endif
+
+// threads that fetch file metadata for a cold listing of a big directory, see dir_scan()
+#ifndef DEFAULT_DIR_THREADS
+#define DEFAULT_DIR_THREADS 4
+#endif
+#define DIR_THREADS_MAX 64
+
+// -v logging is written out by a background thread, see log_start()
+#ifndef DEFAULT_LOG_ASYNC
+#define DEFAULT_LOG_ASYNC true
+#endif
+
+// To mimic the original Desk-Link from Travelling Software:
+#ifndef TSDOS_ROOT_LABEL
+#define TSDOS_ROOT_LABEL   "0:    "
+#endif
+#ifndef TSDOS_PARENT_LABEL
+#define TSDOS_PARENT_LABEL "^     "
+#endif
+// you can't change this unless you also hack ts-dos
+#define TSDOS_DIR_LABEL    "<>"
+
+// receive buffer size, must be a power of 2
+#define RX_BUF_LEN 2048
+
+// read-ahead window for files open for reading
+#define READ_AHEAD_LEN 65536
+
+// write-behind buffer for files open for writing,
+// flushed when full, on close, and after this many ms without client input
+#define WRITE_BEHIND_LEN 65536
+#define WRITE_BEHIND_MS 1000
+
+// RET_DIRENT response, fmt len name[24] attr len[2] free chk
+#define DIRENT_FRAME_LEN 31
+
+// why serve_session() or serve_client() returned
+#define SES_OK 0
+#define SES_DROP_CMD 1 // the client stalled in the middle of a request
+#define SES_CLOSE 2    // hangup or error on tty_fd
+#define SES_QUIT 3     // quit_sig is set
+
+// everything about one client connection
+typedef struct {
+	char tty_name[PATH_MAX+1];
+	int tty_fd;
+	struct termios termios;
+	char share_path[2][PATH_MAX+1];
+	int operation_mode;
+	int stall_ms;               // give up on a request after this long without input, 0 = never
+	jmp_buf jmp;                // see session_abort()
+	uint8_t gb[TPDD_MSG_MAX+3]; // one whole packet, fmt len payload chk
+	uint8_t rx_buf[RX_BUF_LEN]; // ring buffer of bytes received from the client
+	unsigned rx_head;           // free-running read index
+	unsigned rx_tail;           // free-running write index
+	long rx_ms;                 // time of the last input, for the write-behind timer
+	FILE_LIST files;
+	FILE_ENTRY* cur_file;
+	FILE_ENTRY new_file;        // cur_file when it's not in files
+	uint8_t* dirent_frames;     // files encoded as ready to send RET_DIRENT frames, see ret_dirent()
+	unsigned dirent_frames_max; // allocated
+	unsigned dirent_frames_n;   // valid, files + 1 for the end, 0 = rebuild
+	uint8_t dirent_free;        // free sectors, for RET_DIRENT
+	bool in_img;                // files is from the disk image, see img_fs.c
+	int f_open_mode;
+	int o_file_h;
+	uint8_t ra_buf[READ_AHEAD_LEN]; // read-ahead window of o_file_h
+	int ra_head;                // next byte to send
+	int ra_tail;                // end of data
+	uint8_t wb_buf[WRITE_BEHIND_LEN]; // write-behind buffer of o_file_h
+	int wb_len;
+	uint8_t wb_err;             // deferred write error, for the next status or close
+	int img_bank;               // file open in the disk image instead of o_file_h, -1 = none
+	uint8_t img_attr;
+	char img_name[TPDD_FILENAME_LEN+1];
+	int dir_fd;                 // cwd, everything local is opened relative to this
+	char cwd[PATH_MAX+1];
+	char dme_cwd[7];
+	uint8_t in_dme;
+	uint8_t bank;
+	int dir_depth;
+	uint8_t pdd1_condition;     // pdd1 condition bit flags
+	uint8_t pdd2_condition;     // pdd2 condition bit flags
+	uint8_t* disk_rec;          // current disk image record, set by open_disk_image()
+	DISK_OVL* disk_ovl;         // this session's changes to the disk image, with -o
+	unsigned disk_seen;         // disk_change() count when the disk was last looked at
+	uint8_t rb[SECTOR_LEN];     // pdd1 disk image record buffer
+	// drive cpu memory map
+	uint8_t ioport[IOPORT_LEN]; // i/o port
+	uint8_t cpuram[CPURAM_LEN]; // 128 bytes cpu internal ram
+	uint8_t ga[GA_LEN];         // gate array interface
+	uint8_t ram[RAM_LEN];       // 2k ram (pdd2 disk image record buffer)
+	// for stats.c, per request
+	long st_disk_t;             // when the disk image was locked
+	unsigned st_out;            // bytes sent
+	int st_err;                 // last error code sent
+	int cap_fd;                 // capture file, see capture.c, -1 = none
+	long cap_us;                // time of the last capture record
+	// for the server loop, not used by the handlers
+	bool busy;                  // handed to a worker thread
+	int served;                 // what serve_session() returned
+} SESSION;
+
+// config, shared by all sessions, set up before serving
+extern int debug;
+extern int start_mode;
+extern bool upcase;
+extern bool tildes;
+extern bool fsync_close;
+extern bool disk_fs;
+extern int dir_threads;
+extern bool log_async;
+extern uint8_t model;
+extern char disk_img_fname[PATH_MAX+1];
+extern char disk_ovl_dir[PATH_MAX+1];
+extern char app_lib_dir[PATH_MAX+1];
+extern char dme_root_label[7];
+extern char dme_parent_label[7];
+extern char dme_dir_label[3];
+extern uint8_t cfnl;
+extern uint8_t base_len;
+extern uint8_t ext_len;
+extern char default_attr;
+extern bool enable_magic_files;
+extern bool pad_fn;
+extern bool dme_en;
+extern uint8_t rom[ROM_LEN];
+extern atomic_int quit_sig;
+
+void dbg (const int v, const char* format, ...);
+void dbg_b (const int v, unsigned char* b, int n);
+void dbg_p (const int v, unsigned char* b);
+void log_start (void);
+void log_flush (void);
+void log_stop (void);
+long now_ms (void);
+long now_us (void);
+
+SESSION* session_new (const char* tty, const char* path, const char* path1);
+void session_free (SESSION* ses);
+void cd_share_path (SESSION* ses);
+void update_file_list (SESSION* ses, int m);
+void dirent_frames_build (SESSION* ses);
+void dirent_frame_update (SESSION* ses, FILE_ENTRY* ep);
+FILE_ENTRY* make_file_entry (FILE_ENTRY* f, char* namep, uint8_t attr, uint16_t len, char flags);
+
+int  write_client_tty (SESSION* ses, void* b, int n);
+int  read_client_tty (SESSION* ses, void* b, const unsigned int n);
+uint8_t wb_flush (SESSION* ses);
+uint8_t close_o_file (SESSION* ses);
+int  open_disk_image (SESSION* ses, int p, int m);
+int  disk_change (const char* f, int sync);
+void disk_name (char* b);
+void close_disk_image (SESSION* ses);
+
+int  serve_session (SESSION* ses);
+int  serve_client (SESSION* ses);
+
+#endif
@@ -14,6 +14,9 @@
 #include <sys/xattr.h>
 #endif
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "xattr.h"
 
 #ifndef XATTR_NAME
@@ -50,6 +53,14 @@ void dl_fgetxattr(int fd, uint8_t* value) {
 #endif
 }
 
+// name in the directory open at dirfd, without building the full path
+void dl_getxattrat(int dirfd, const char* name, uint8_t* value) {
+	int fd = openat(dirfd, name, O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+	if (fd<0) return;
+	dl_fgetxattr(fd, value);
+	close(fd);
+}
+
 void dl_fsetxattr(int fd, const uint8_t* value) {
 #if defined(__linux__)
 	fsetxattr(fd, xattr_name, value, 1, 0);